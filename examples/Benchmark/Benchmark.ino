@@ -0,0 +1,465 @@
+#include <GS.h>
+#include <SPI.h>
+
+// Exposes the per-byte RX state machine, to compare block processing
+// against in benchmark_rx_processing()
+class BenchmarkModule : public GSModule {
+public:
+  bool processByte(uint8_t c) { return processIncoming((int)c); }
+};
+
+BenchmarkModule gs;
+
+#define SSID "Foo"
+#define PASSPHRASE "Bar"
+
+// Host to send benchmark data to. Data is sent to the UDP discard
+// port, so nothing is sent back.
+IPAddress sink(192, 168, 1, 1);
+const uint16_t SINK_PORT = 9;
+
+// Port to listen on for the receive buffer capacity benchmark
+const uint16_t CAPACITY_PORT = 5000;
+// How long to wait for packets for the capacity benchmark
+const uint32_t CAPACITY_WAIT = 10000;
+
+const uint16_t FRAME_SIZE = 1400;
+const uint16_t FRAME_COUNT = 50;
+
+// Cid used for the RX processing benchmark, should not be in use
+const GSModule::cid_t RX_CID = 1;
+
+// Define to run the bulk benchmarks over this UART instead of SPI,
+// repeating them at each of the baud rates below.
+//#define GS_UART Serial1
+const uint32_t UART_BAUD = 115200;
+const uint32_t UART_BAUD_RATES[] = {115200, 230400, 460800, 921600};
+
+uint8_t frame[FRAME_SIZE];
+
+static void report(const char *name, uint32_t bytes, uint32_t start)
+{
+  uint32_t duration = millis() - start;
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(bytes);
+  Serial.print(" bytes in ");
+  Serial.print(duration);
+  Serial.print(" ms = ");
+  Serial.print(duration ? bytes * 1000 / duration : 0);
+  Serial.println(" bytes/sec");
+}
+
+static void report_us(const char *name, uint32_t bytes, uint32_t start)
+{
+  uint32_t duration = micros() - start;
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(bytes);
+  Serial.print(" bytes in ");
+  Serial.print(duration);
+  Serial.print(" us = ");
+  Serial.print(duration ? bytes * 1000 / duration : 0);
+  Serial.println(" bytes/ms");
+}
+
+static void report_startup()
+{
+  const GSModule::StartupStats& stats = gs.getStartupStats();
+  Serial.print("Startup (");
+  Serial.print(stats.warm ? "warm" : "cold");
+  Serial.print("): probe ");
+  Serial.print(stats.probe_time);
+  Serial.print(" ms, banner ");
+  Serial.print(stats.banner_time);
+  Serial.print(" ms, ");
+  Serial.print(stats.commands);
+  Serial.print(" setup commands in ");
+  Serial.print(stats.setup_time);
+  Serial.print(" ms, total ");
+  Serial.print(stats.total_time);
+  Serial.println(" ms");
+}
+
+// The per-byte SPI escaping that encodeSpi() and decodeSpi() replaced
+// (the former GSCore::isSpiSpecial() and processSpiSpecial(), without
+// logging), kept here to compare against
+static bool spi_prev_was_esc = false;
+static bool spi_xoff = false;
+
+static bool is_spi_special(uint8_t c)
+{
+  switch(c) {
+    case 0xff: // SPI_SPECIAL_ALL_ONE
+    case 0x00: // SPI_SPECIAL_ALL_ZERO
+    case 0xf3: // SPI_SPECIAL_ACK
+    case 0xf5: // SPI_SPECIAL_IDLE
+    case 0xfa: // SPI_SPECIAL_XOFF
+    case 0xfd: // SPI_SPECIAL_XON
+    case 0xfb: // SPI_SPECIAL_ESC
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int process_spi_special(uint8_t c)
+{
+  static uint8_t errorcount = 0;
+  int res = -1;
+  if (spi_prev_was_esc) {
+    spi_prev_was_esc = false;
+    res = c ^ 0x20;
+  } else {
+    if (c != 0xff)
+      errorcount = 0;
+    switch(c) {
+      case 0xff:
+        if (++errorcount > 20)
+          errorcount = 0;
+        break;
+      case 0x00:
+      case 0xf3:
+      case 0xf5:
+        break;
+      case 0xfa:
+        spi_xoff = true;
+        break;
+      case 0xfd:
+        spi_xoff = false;
+        break;
+      case 0xfb:
+        spi_prev_was_esc = true;
+        break;
+      default:
+        res = c;
+        break;
+    }
+  }
+  return res;
+}
+
+// Measures the SPI escaping code only, no SPI transfers are done
+static void benchmark_spi_encoding()
+{
+  static uint8_t encoded[2 * FRAME_SIZE];
+  static uint8_t decoded[FRAME_SIZE];
+  uint16_t len = 0;
+  uint32_t start;
+
+  start = micros();
+  for (uint16_t i = 0; i < sizeof(frame); ++i) {
+    if (is_spi_special(frame[i])) {
+      encoded[len++] = 0xfb;
+      encoded[len++] = frame[i] ^ 0x20;
+    } else {
+      encoded[len++] = frame[i];
+    }
+  }
+  report_us("SPI encode, per byte (switch)", sizeof(frame), start);
+
+  start = micros();
+  len = GSCore::encodeSpi(frame, sizeof(frame), encoded);
+  report_us("SPI encode, whole frame (table)", sizeof(frame), start);
+
+  start = micros();
+  uint16_t n = 0;
+  for (uint16_t i = 0; i < len; ++i) {
+    int c = process_spi_special(encoded[i]);
+    if (c >= 0)
+      decoded[n++] = c;
+  }
+  report_us("SPI decode, per byte (switch)", n, start);
+
+  start = micros();
+  n = gs.decodeSpi(encoded, len, decoded);
+  report_us("SPI decode, whole frame (table)", n, start);
+}
+
+static void report_calls(const char *name, uint16_t calls, uint32_t start)
+{
+  uint32_t duration = micros() - start;
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(calls);
+  Serial.print(" calls in ");
+  Serial.print(duration);
+  Serial.println(" us");
+}
+
+// Compares the formatting helpers used for frame headers and commands
+// with snprintf
+static void benchmark_formatting()
+{
+  const uint16_t CALLS = 1000;
+  IPAddress ip(192, 168, 123, 254);
+  char buf[32];
+  uint32_t start;
+
+  start = micros();
+  for (uint16_t i = 0; i < CALLS; ++i)
+    snprintf(buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  report_calls("IP address, snprintf", CALLS, start);
+
+  start = micros();
+  for (uint16_t i = 0; i < CALLS; ++i)
+    GSCore::formatIpAddress(buf, ip);
+  report_calls("IP address, formatIpAddress", CALLS, start);
+
+  start = micros();
+  for (uint16_t i = 0; i < CALLS; ++i)
+    snprintf(buf, sizeof(buf), "\x1bZ%x%04d", i & 0xf, i);
+  report_calls("Frame header, snprintf", CALLS, start);
+
+  start = micros();
+  for (uint16_t i = 0; i < CALLS; ++i) {
+    buf[0] = 0x1b;
+    buf[1] = 'Z';
+    buf[2] = GSCore::formatHexDigit(i & 0xf);
+    GSCore::formatLength(buf + 3, i);
+  }
+  report_calls("Frame header, formatLength", CALLS, start);
+}
+
+// Feeds a received frame to the RX state machine in chunks of chunk
+// bytes, consuming the buffered data after every chunk. No SPI
+// transfers are done, this measures just the processing of received
+// bytes.
+static void feed_frame(const uint8_t *data, uint16_t len, uint8_t chunk, bool per_byte)
+{
+  for (uint16_t off = 0; off < len; off += chunk) {
+    uint16_t n = len - off < chunk ? len - off : chunk;
+    if (per_byte) {
+      for (uint16_t i = 0; i < n; ++i)
+        gs.processByte(data[off + i]);
+    } else {
+      gs.processIncoming(&data[off], n);
+    }
+    // Every chunk contains some payload, so this never reads from the
+    // module
+    if (gs.getFrameHeader(RX_CID))
+      gs.consumeData(RX_CID, n);
+  }
+}
+
+// Measures processing of received data, byte by byte versus in blocks
+static void benchmark_rx_processing()
+{
+  // A bulk data frame for RX_CID containing the entire frame buffer
+  static uint8_t stream[7 + FRAME_SIZE];
+  stream[0] = 0x1b;
+  stream[1] = 'Z';
+  stream[2] = '0' + RX_CID;
+  stream[3] = '0' + FRAME_SIZE / 1000 % 10;
+  stream[4] = '0' + FRAME_SIZE / 100 % 10;
+  stream[5] = '0' + FRAME_SIZE / 10 % 10;
+  stream[6] = '0' + FRAME_SIZE % 10;
+  memcpy(&stream[7], frame, FRAME_SIZE);
+
+  uint32_t start = micros();
+  for (uint16_t i = 0; i < FRAME_COUNT; ++i)
+    feed_frame(stream, sizeof(stream), 2 * 32, true);
+  report_us("RX processing, per byte", (uint32_t)FRAME_COUNT * FRAME_SIZE, start);
+
+  start = micros();
+  for (uint16_t i = 0; i < FRAME_COUNT; ++i)
+    feed_frame(stream, sizeof(stream), 2 * 32, false);
+  report_us("RX processing, per block", (uint32_t)FRAME_COUNT * FRAME_SIZE, start);
+}
+
+static void benchmark_bulk(const char *name, GSModule::cid_t cid)
+{
+  uint32_t start = millis();
+  uint32_t bytes = 0;
+  for (uint16_t i = 0; i < FRAME_COUNT; ++i) {
+    if (gs.writeData(cid, frame, sizeof(frame)))
+      bytes += sizeof(frame);
+  }
+  // In pipelined mode, include the time until the last frame is
+  // acknowledged
+  gs.flushTxFrames();
+  report(name, bytes, start);
+}
+
+#ifdef GS_UART
+static bool set_uart_baud(void *data, uint32_t baud, bool check_only)
+{
+  if (check_only) {
+    // HardwareSerial runs at F_CPU / (8 * divisor). Refuse rates that
+    // end up more than 2.5% off, the module would not understand us.
+    uint32_t divisor = (F_CPU / 4 / baud + 1) / 2;
+    if (divisor == 0)
+      return false;
+    uint32_t actual = F_CPU / 8 / divisor;
+    uint32_t diff = (actual > baud ? actual - baud : baud - actual);
+    return diff * 40 <= baud;
+  }
+
+  GS_UART.flush();
+  GS_UART.begin(baud);
+  return true;
+}
+
+// Runs the bulk benchmark at each of UART_BAUD_RATES
+static void benchmark_uart_baud_rates(GSModule::cid_t cid)
+{
+  uint32_t current = UART_BAUD;
+  for (uint8_t i = 0; i < sizeof(UART_BAUD_RATES) / sizeof(*UART_BAUD_RATES); ++i) {
+    uint32_t baud = UART_BAUD_RATES[i];
+    if (baud != current) {
+      if (!gs.negotiateBaudRate(baud, current, set_uart_baud, NULL)) {
+        Serial.print("Switching to ");
+        Serial.print(baud);
+        Serial.println(" baud failed");
+        continue;
+      }
+      current = baud;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "UART, %lu baud", (unsigned long)baud);
+    benchmark_bulk(name, cid);
+  }
+
+  // Leave the link at the default rate again
+  if (current != UART_BAUD)
+    gs.negotiateBaudRate(UART_BAUD, current, set_uart_baud, NULL);
+}
+#endif
+
+// Measures how much payload fits in the receive buffer when receiving
+// small UDP packets. While this runs, send a bunch of small packets to
+// CAPACITY_PORT, for example using:
+//
+//   for i in $(seq 100); do echo -n 0123456789 | nc -u -q0 <ip> 5000; done
+//
+// The packets are buffered without reading them, so the buffer fills
+// up. Afterwards, all buffered packets are read and counted.
+static void benchmark_rx_capacity()
+{
+  GSModule::cid_t cid = gs.listenUdp(CAPACITY_PORT);
+  if (cid == GSModule::INVALID_CID) {
+    Serial.println("Listening failed");
+    return;
+  }
+
+  Serial.print("Send small UDP packets to port ");
+  Serial.println(CAPACITY_PORT);
+  uint32_t start = millis();
+  while (millis() - start < CAPACITY_WAIT)
+    gs.loop();
+
+  GSModule::RxStats stats = gs.getRxStats(cid);
+  uint16_t packets = 0;
+  uint32_t payload = 0;
+  GSModule::RXFrame header;
+  while ((header = gs.getFrameHeader(cid))) {
+    packets++;
+    payload += header.length;
+    // Read only this packet, since readData() continues with the next
+    // packet when the buffer is not full yet.
+    while (header.length) {
+      size_t len = gs.readData(cid, frame, header.length < sizeof(frame) ? header.length : sizeof(frame));
+      if (!len)
+        break;
+      header.length -= len;
+    }
+  }
+
+  Serial.print("RX capacity: ");
+  Serial.print(packets);
+  Serial.print(" packets, ");
+  Serial.print(payload);
+  Serial.print(" payload bytes in ");
+  Serial.print(stats.queued);
+  Serial.print(" buffered bytes (");
+  Serial.print(stats.queued ? payload * 100 / stats.queued : 0);
+  Serial.print("% payload), ");
+  Serial.print(stats.dropped_frames);
+  Serial.println(" packets dropped");
+
+  gs.disconnect(cid);
+}
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Gainspan throughput benchmark");
+  #ifdef VCC_ENABLE // For the Pinoccio scout
+  pinMode(VCC_ENABLE, OUTPUT);
+  digitalWrite(VCC_ENABLE, HIGH);
+  #endif
+  delay(2000);
+
+  // Fill the frame with all possible byte values, so SPI escaping
+  // overhead is included as well.
+  for (uint16_t i = 0; i < sizeof(frame); ++i)
+    frame[i] = i;
+
+  benchmark_spi_encoding();
+  benchmark_formatting();
+
+  // Use SPI with SS on pin 7 (or the UART). With fast start, a reset
+  // of just the Arduino does not have to wait for the module.
+  gs.setFastStart(true);
+  #ifdef GS_UART
+  GS_UART.begin(UART_BAUD);
+  gs.begin(GS_UART);
+  #else
+  gs.begin(7);
+  #endif
+  report_startup();
+
+  // Disable the NCM, just in case it was set to autostart. Wait a bit
+  // before doing so, because it seems that if the NCM is configured to
+  // start on boot and we try to disable it within the first second or
+  // so, the module locks up...
+  delay(1000);
+  gs.setNcm(false);
+
+  benchmark_rx_processing();
+
+  gs.setDhcp(true, "pinoccio");
+  gs.setSecurity(GSModule::GS_SECURITY_WPA_PSK);
+  gs.setWpaPassphrase(PASSPHRASE);
+  while(!gs.associate(SSID)) {
+    Serial.println("Association failed, retrying...");
+    gs.loop();
+  }
+
+  Serial.println("Associated to " SSID);
+
+  GSModule::cid_t cid = gs.connectUdp(sink, SINK_PORT);
+  if (cid == GSModule::INVALID_CID) {
+    Serial.println("Connection failed");
+    return;
+  }
+
+  #ifdef GS_UART
+  benchmark_uart_baud_rates(cid);
+  #else
+  // Toggle SS for every byte, like the module originally required
+  gs.setSpiBurst(false);
+  benchmark_bulk("SPI, SS per byte", cid);
+
+  // Keep SS low during a block transfer
+  gs.setSpiBurst(true);
+  benchmark_bulk("SPI, burst", cid);
+
+  // Do not wait for the module to acknowledge every frame
+  gs.setTxPipeline(4);
+  benchmark_bulk("SPI, burst, pipelined", cid);
+  gs.setTxPipeline(0);
+  #endif
+
+  gs.disconnect(cid);
+
+  benchmark_rx_capacity();
+
+  Serial.println("setup() done");
+}
+
+void loop() {
+  gs.loop();
+}
+
+/* vim: set filetype=cpp softtabstop=2 shiftwidth=2 expandtab: */
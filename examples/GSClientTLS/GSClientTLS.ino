@@ -71,9 +71,16 @@ void setup() {
   Serial.print("Connected to ");
   Serial.println(ip);
 
-  uint8_t request[] = "GET / HTTP/1.0\r\n\r\n";
-  if (client.write(request, sizeof(request) - 1) == 0)
-    Serial.print("Write failed?");;
+  // Collect the request in a buffer, so it is sent as a single data
+  // frame, instead of a frame for every print() call.
+  static uint8_t write_buf[128];
+  client.setWriteBuffer(write_buf, sizeof(write_buf));
+
+  client.print("GET / HTTP/1.0\r\n");
+  client.print("Host: ");
+  client.println(ip);
+  client.println();
+  client.flush();
 
   while(client.connected()) {
     if (client.available()) {
@@ -34,6 +34,27 @@ size_t GSClient::write(uint8_t c)
 
 size_t GSClient::write(const uint8_t *buf, size_t size)
 {
+  if (this->write_buf) {
+    checkWriteTimeout();
+
+    if (this->write_len + size > this->write_size) {
+      if (!flushWriteBuffer())
+        return 0;
+    }
+
+    // Data that does not fit in the (now empty) buffer is written
+    // directly
+    if (size < this->write_size) {
+      if (this->write_len == 0)
+        this->write_start = millis();
+      memcpy(this->write_buf + this->write_len, buf, size);
+      this->write_len += size;
+      if (this->write_len == this->write_size && !flushWriteBuffer())
+        return 0;
+      return size;
+    }
+  }
+
   if (!gs.writeData(this->cid, buf, size))
     return 0;
   return size;
@@ -41,31 +62,36 @@ size_t GSClient::write(const uint8_t *buf, size_t size)
 
 int GSClient::available()
 {
+  checkWriteTimeout();
   return gs.availableData(this->cid);
 }
 
 int GSClient::read()
 {
+  checkWriteTimeout();
   return gs.readData(this->cid);
 }
 
 int GSClient::read(uint8_t *buf, size_t size)
 {
+  checkWriteTimeout();
   return gs.readData(this->cid, buf, size);
 }
 
 int GSClient::peek()
 {
+  checkWriteTimeout();
   return gs.peekData(this->cid);
 }
 
 void GSClient::flush()
 {
-  // Nothing todo, we don't keep any buffers
+  flushWriteBuffer();
 }
 
 void GSClient::stop()
 {
+  flushWriteBuffer();
   gs.disconnect(this->cid);
 }
 
@@ -73,9 +99,37 @@ uint8_t GSClient::connected()
 {
   if (this->cid == GSModule::INVALID_CID)
     return false;
+  checkWriteTimeout();
   return gs.getConnectionInfo(this->cid).connected;
 }
 
+void GSClient::setWriteBuffer(uint8_t *buf, uint16_t size, uint16_t timeout)
+{
+  flushWriteBuffer();
+  // Bigger frames are split by writeData() anyway
+  if (size > GSCore::MAX_FRAME_SIZE)
+    size = GSCore::MAX_FRAME_SIZE;
+  this->write_buf = size ? buf : NULL;
+  this->write_size = size;
+  this->write_timeout = timeout;
+}
+
+bool GSClient::flushWriteBuffer()
+{
+  if (this->write_len == 0)
+    return true;
+
+  uint16_t len = this->write_len;
+  this->write_len = 0;
+  return gs.writeData(this->cid, this->write_buf, len);
+}
+
+void GSClient::checkWriteTimeout()
+{
+  if (this->write_len && (unsigned long)(millis() - this->write_start) >= this->write_timeout)
+    flushWriteBuffer();
+}
+
 GSClient::operator bool()
 {
   return (this->cid != GSModule::INVALID_CID);
@@ -83,6 +137,8 @@ GSClient::operator bool()
 
 GSClient& GSClient::operator =(GSCore::cid_t cid)
 {
+  // Buffered data belongs to the old cid
+  flushWriteBuffer();
   this->cid = cid;
   return *this;
 }
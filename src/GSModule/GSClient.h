@@ -34,7 +34,7 @@
 
 class GSClient : public Client {
   public:
-    GSClient(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
+    GSClient(GSModuleBase &gs) : gs(gs), cid(GSModule::INVALID_CID), write_buf(NULL), write_size(0), write_len(0) { } ;
 
     /****************************************************************
      * Stuff from Client / Stream / Print
@@ -54,10 +54,56 @@ class GSClient : public Client {
     // Include other overloads of write
     using Print::write;
 
+    /****************************************************************
+     * Gainspan-specific stuff
+     ****************************************************************/
+
+    /**
+     * Collect written data in the given buffer, instead of sending
+     * every write() as a separate data frame. This makes a big
+     * difference when using print(), which writes every number or
+     * string separately.
+     *
+     * Buffered data is sent when the buffer is full, on flush() or
+     * stop(), and when the client is used (e.g. through write() or
+     * available()) timeout milliseconds after the first byte was
+     * buffered. For UDP, every flush produces a single packet.
+     *
+     * @param buf     The buffer to use, or NULL to disable buffering.
+     *                Should stay valid as long as this client uses it.
+     * @param size    The size of buf. At most 1400 bytes will be used,
+     *                since that is the maximum frame size.
+     * @param timeout The maximum number of milliseconds to keep data
+     *                buffered.
+     */
+    void setWriteBuffer(uint8_t *buf, uint16_t size, uint16_t timeout = 20);
+
   protected:
-    GSModule &gs;
+    /**
+     * Send any buffered data.
+     *
+     * @returns false when sending failed, in which case the buffered
+     *          data is lost.
+     */
+    bool flushWriteBuffer();
+
+    /**
+     * Send buffered data when it has been buffered longer than the
+     * timeout.
+     */
+    void checkWriteTimeout();
+
+    GSModuleBase &gs;
     GSModule::cid_t cid;
 
+    /** Buffer for written data, see setWriteBuffer() */
+    uint8_t *write_buf;
+    uint16_t write_size;
+    uint16_t write_len;
+    uint16_t write_timeout;
+    /** When the first byte in write_buf was written */
+    unsigned long write_start;
+
 };
 
 #endif // _GS_CLIENT_H
@@ -51,22 +51,94 @@ static void dump_byte(Print *p, const char *prefix, int c, bool newline = true)
   }
 }
 
+/**
+ * Classes of bytes, as sent or received through SPI. All classes except
+ * SPI_CLASS_DATA must be escaped when sent.
+ */
+enum SPIByteClass {
+  SPI_CLASS_DATA,
+  SPI_CLASS_ALL_ZERO,
+  SPI_CLASS_ACK,
+  SPI_CLASS_IDLE,
+  SPI_CLASS_XOFF,
+  SPI_CLASS_XON,
+  SPI_CLASS_ESC,
+  SPI_CLASS_ALL_ONE,
+};
+
+/**
+ * Lookup table to classify SPI bytes. This corresponds to the
+ * GSCore::SPI_SPECIAL_* constants.
+ */
+#define D SPI_CLASS_DATA
+static const uint8_t spi_byte_class[256] PROGMEM = {
+  /* 0x00 */ SPI_CLASS_ALL_ZERO, D, D, D, D, D, D, D,
+  /* 0x08 */ D, D, D, D, D, D, D, D,
+  /* 0x10 */ D, D, D, D, D, D, D, D,
+  /* 0x18 */ D, D, D, D, D, D, D, D,
+  /* 0x20 */ D, D, D, D, D, D, D, D,
+  /* 0x28 */ D, D, D, D, D, D, D, D,
+  /* 0x30 */ D, D, D, D, D, D, D, D,
+  /* 0x38 */ D, D, D, D, D, D, D, D,
+  /* 0x40 */ D, D, D, D, D, D, D, D,
+  /* 0x48 */ D, D, D, D, D, D, D, D,
+  /* 0x50 */ D, D, D, D, D, D, D, D,
+  /* 0x58 */ D, D, D, D, D, D, D, D,
+  /* 0x60 */ D, D, D, D, D, D, D, D,
+  /* 0x68 */ D, D, D, D, D, D, D, D,
+  /* 0x70 */ D, D, D, D, D, D, D, D,
+  /* 0x78 */ D, D, D, D, D, D, D, D,
+  /* 0x80 */ D, D, D, D, D, D, D, D,
+  /* 0x88 */ D, D, D, D, D, D, D, D,
+  /* 0x90 */ D, D, D, D, D, D, D, D,
+  /* 0x98 */ D, D, D, D, D, D, D, D,
+  /* 0xa0 */ D, D, D, D, D, D, D, D,
+  /* 0xa8 */ D, D, D, D, D, D, D, D,
+  /* 0xb0 */ D, D, D, D, D, D, D, D,
+  /* 0xb8 */ D, D, D, D, D, D, D, D,
+  /* 0xc0 */ D, D, D, D, D, D, D, D,
+  /* 0xc8 */ D, D, D, D, D, D, D, D,
+  /* 0xd0 */ D, D, D, D, D, D, D, D,
+  /* 0xd8 */ D, D, D, D, D, D, D, D,
+  /* 0xe0 */ D, D, D, D, D, D, D, D,
+  /* 0xe8 */ D, D, D, D, D, D, D, D,
+  /* 0xf0 */ D, D, D, SPI_CLASS_ACK, D, SPI_CLASS_IDLE, D, D,
+  /* 0xf8 */ D, D, SPI_CLASS_XOFF, SPI_CLASS_ESC, D, SPI_CLASS_XON, D, SPI_CLASS_ALL_ONE,
+};
+#undef D
+
+// Default response timeouts, indexed by GSTimeout
+static const uint32_t default_timeouts[] = {
+  /* GS_TIMEOUT_CONFIG */ 500,
+  /* GS_TIMEOUT_FLASH */ 2 * 1000,
+  /* GS_TIMEOUT_ASSOCIATE */ 20 * 1000,
+  /* GS_TIMEOUT_DNS */ 10 * 1000,
+  /* GS_TIMEOUT_CONNECT */ 10 * 1000,
+  /* GS_TIMEOUT_TLS */ 15 * 1000,
+};
+
 /*******************************************************
  * Methods for setting up the module
  *******************************************************/
 
-GSCore::GSCore()
+void GSCore::init()
 {
   static_assert( max_for_type(__typeof__(rx_async_len)) >= sizeof(rx_async) - 1, "rx_async_len is too small for rx_async" );
-  static_assert( max_for_type(rx_data_index_t) >= sizeof(rx_data) - 1, "rx_data_index_t is too small for rx_data" );
-  // Check that the buffer size is a power of two, which makes all
-  // modulo operations efficient bitwise ands. Additionally, this also
-  // guarantees that the size of rx_data (which is a power of two by
-  // definition) is divisible by the buffer size, which is needed to
-  // guarantee proper negative wraparound.
-  static_assert( is_power_of_two(sizeof(rx_data)), "rx_data size is not a power of two" );
+  static_assert( RX_UDP_HEADER_SIZE <= RX_BLOCK_SIZE, "RX_BLOCK_SIZE is smaller than a frame header" );
+  static_assert( is_power_of_two(RX_BLOCK_SIZE), "RX_BLOCK_SIZE is not a power of two" );
+  static_assert( is_power_of_two(TX_PIPELINE_SIZE), "TX_PIPELINE_SIZE is not a power of two" );
+  static_assert( is_power_of_two(ASYNC_WRITE_QUEUE_SIZE), "ASYNC_WRITE_QUEUE_SIZE is not a power of two" );
+  static_assert( is_power_of_two(COMMAND_QUEUE_SIZE), "COMMAND_QUEUE_SIZE is not a power of two" );
+  static_assert( sizeof(default_timeouts) == sizeof(timeouts), "default_timeouts does not match GSTimeout" );
   this->debug = NULL;
   this->error = NULL;
+  memcpy(this->timeouts, default_timeouts, sizeof(this->timeouts));
+  this->next_timeout = this->next_class_timeout = 0;
+  this->response_timeout = this->timeouts[GS_TIMEOUT_CONFIG];
+  for (cid_t cid = 0; cid <= this->max_cid; ++cid) {
+    this->rx_queues[cid].budget = this->rx_block_count;
+    this->rx_queues[cid].on_data = NULL;
+  }
 }
 
 bool GSCore::begin(Stream &serial)
@@ -74,6 +146,12 @@ bool GSCore::begin(Stream &serial)
   if (this->serial || this->ss_pin != INVALID_PIN)
     return false;
 
+  if (this->rx_overflow_policy == GS_RX_BACKPRESSURE) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("GS_RX_BACKPRESSURE is not supported in UART mode");
+    return false;
+  }
+
   this->initializing = true;
   this->serial = &serial;
   bool res = _begin();
@@ -102,18 +180,158 @@ bool GSCore::begin(uint8_t ss, uint8_t data_ready, SPISettings settings)
 bool GSCore::_begin()
 {
   this->rx_state = GS_RX_IDLE;
-  this->rx_data_head = this->rx_data_tail = 0;
-  this->tail_frame.length = 0;
+  for (uint8_t i = 0; i < this->rx_block_count; ++i)
+    this->rx_block_next[i] = (i + 1 < this->rx_block_count ? i + 1 : RX_NO_BLOCK);
+  this->rx_free_block = 0;
+  this->rx_free_count = this->rx_block_count;
+  for (cid_t cid = 0; cid <= this->max_cid; ++cid) {
+    this->rx_queues[cid].first = this->rx_queues[cid].last = RX_NO_BLOCK;
+    this->rx_queues[cid].blocks = 0;
+    this->rx_queues[cid].left = 0;
+    this->rx_queues[cid].dropped_frames = 0;
+    this->rx_queues[cid].dropped_bytes = 0;
+  }
+  this->rx_any_cid = INVALID_CID;
+  this->rx_discard = false;
   this->spi_prev_was_esc = false;
   this->spi_xoff = false;
+  this->spi_rx_head = this->spi_rx_tail = 0;
+  this->tx_queue_head = this->tx_queue_tail = 0;
+  this->tx_sent = this->tx_dropped = 0;
+  this->tx_frames_head = this->tx_frames_acked = this->tx_frames_tail = 0;
+  this->tx_frames_failed = 0;
+  this->async_head = this->async_send = this->async_tail = 0;
+  this->async_sending = false;
+  this->command_head = this->command_tail = 0;
+  this->command_sent = false;
+  this->command_text_len = 0;
+  this->rx_response = NULL;
+  this->resync_needed = false;
+  this->resync_failures = 0;
   this->ncm_auto_cid = INVALID_CID;
   this->events = 0;
-  this->spi_poll_time = micros() - MINIMUM_POLL_INTERVAL;
+  memset(&this->poll_stats, 0, sizeof(this->poll_stats));
+  this->poll_stats.interval = this->spi_poll_min;
+  this->spi_poll_time = micros() - this->poll_stats.interval;
 
-  // TODO: Query AT+NSTAT=? to see if we are aready connected (in case
-  // the NCM already connected before we were initialized).
+  // On a warm start, restoreState() finds out if we are associated
+  // already
   this->associated = false;
 
+  memset(&this->startup_stats, 0, sizeof(this->startup_stats));
+  uint32_t begin_start = millis();
+  uint8_t done = 0;
+  bool banner = false;
+
+  if (this->fast_start) {
+    uint32_t probe_start = millis();
+    bool replied = probeModule(&done, &banner);
+    this->startup_stats.probe_time = millis() - probe_start;
+    if (replied) {
+      this->startup_stats.warm = true;
+    } else {
+      // The module is not running yet, so the probe got lost and the
+      // late response can be forgotten.
+      this->resync_needed = false;
+      this->rx_response = NULL;
+      done = 0;
+    }
+  }
+
+  if (!this->startup_stats.warm && !banner) {
+    uint32_t banner_start = millis();
+    if (!waitForBanner())
+      return false;
+    this->startup_stats.banner_time = millis() - banner_start;
+  }
+
+  uint32_t setup_start = millis();
+  if (!sendSetupCommands(done))
+    return false;
+
+  memset(this->connections, 0, (this->max_cid + 1) * sizeof(*this->connections));
+  if (this->startup_stats.warm && !restoreState())
+    return false;
+
+  this->startup_stats.setup_time = millis() - setup_start;
+  this->startup_stats.total_time = millis() - begin_start;
+
+  return true;
+}
+
+// Looks for "WSTATE=CONNECTED" in the output of AT+NSTAT=? (as opposed
+// to "WSTATE=NOT CONNECTED")
+static void parse_nstat_line(const uint8_t *buf, uint16_t len, void *data)
+{
+  static const char connected[] = "WSTATE=CONNECTED";
+  const uint16_t connected_len = sizeof(connected) - 1;
+  for (uint16_t i = 0; i + connected_len <= len; ++i) {
+    if (memcmp(buf + i, connected, connected_len) == 0)
+      *(bool*)data = true;
+  }
+}
+
+void GSCore::parseCidLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  GSCore *gs = (GSCore*)data;
+
+  // Split the line into fields: cid, type, mode, local port, remote
+  // port and remote ip. Server cids might not have the remote fields.
+  const uint8_t *field[6];
+  uint8_t field_len[6];
+  uint8_t fields = 0;
+  uint16_t i = 0;
+  while (fields < lengthof(field)) {
+    while (i < len && (buf[i] == ' ' || buf[i] == '\t'))
+      i++;
+    if (i == len)
+      break;
+    field[fields] = buf + i;
+    while (i < len && buf[i] != ' ' && buf[i] != '\t')
+      i++;
+    field_len[fields] = buf + i - field[fields];
+    fields++;
+  }
+
+  // Skip the header and "No valid Cids"
+  cid_t cid;
+  if (fields < 3 || field_len[0] != 1 || !parseNumber(&cid, field[0], 1, 16) || cid > MAX_CID)
+    return;
+
+  uint16_t local_port = 0, remote_port = 0;
+  IPAddress remote_ip;
+  if (fields < 4 || !parseNumber(&local_port, field[3], field_len[3], 10))
+    local_port = 0;
+  if (fields < 5 || !parseNumber(&remote_port, field[4], field_len[4], 10))
+    remote_port = 0;
+  if (fields < 6 || !parseIpAddress(&remote_ip, (const char*)field[5], field_len[5]))
+    remote_ip = (uint32_t)0;
+
+  // There is no way to tell which connection (if any) was made by the
+  // NCM, so it is treated as a normal connection
+  gs->processConnect(cid, remote_ip, remote_port, local_port, false);
+}
+
+bool GSCore::restoreState()
+{
+  bool associated = false;
+  writeCommand("AT+NSTAT=?");
+  if (readResponse(parse_nstat_line, &associated) == GS_SUCCESS && associated) {
+    writeCommand("AT+CID=?");
+    if (readResponse(parseCidLine, this) == GS_SUCCESS) {
+      this->associated = true;
+      return true;
+    }
+    memset(this->connections, 0, (this->max_cid + 1) * sizeof(*this->connections));
+  }
+
+  // Make sure no connections are left open that we do not know about
+  return writeCommandCheckOk("AT+NCLOSEALL");
+}
+
+
+bool GSCore::waitForBanner()
+{
   // The startup procedure is:
   //  - Wait for the data_ready pin to go high
   //  - Read the startup banner
@@ -146,32 +364,146 @@ bool GSCore::_begin()
   // it (since checking the banner is tricky, there's a few different
   // things that could be printed).
   while(readRaw() != -1) /* nothing */;
+  return true;
+}
+
+// The commands sent by begin() and the AT&V setting each one changes,
+// in the order they should be sent. Disabling verbose mode must come
+// first, otherwise we won't be able to interpret responses.
+static const char * const setup_commands[] = {"ATV0", "ATE0", "AT+BDATA=1", "AT+ASYNCMSGFMT=1"};
+static const char * const setup_settings[] = {"V0", "E0", "+BDATA=1", "+ASYNCMSGFMT=1"};
+static const uint8_t SETUP_COMMAND_COUNT = sizeof(setup_commands) / sizeof(*setup_commands);
+
+struct StartupProbe {
+  uint8_t profiles;
+  uint8_t done;
+  bool banner;
+};
+
+static void parse_probe_setting(const uint8_t *buf, uint16_t len, void *data)
+{
+  StartupProbe *probe = (StartupProbe*)data;
+  for (uint8_t i = 0; i < SETUP_COMMAND_COUNT; ++i) {
+    if (len == strlen(setup_settings[i]) && memcmp(buf, setup_settings[i], len) == 0)
+      probe->done |= (1 << i);
+  }
+}
+
+static void parse_probe_line(const uint8_t *buf, uint16_t len, void *data)
+{
+  StartupProbe *probe = (StartupProbe*)data;
+  // The module might be just starting up, so a banner counts as well
+  if (len >= 11 && memcmp(buf, "Serial2WiFi", 11) == 0)
+    probe->banner = true;
+  GSCore::parseSettingsLine(buf, len, &probe->profiles, parse_probe_setting, probe);
+}
+
+bool GSCore::probeModule(uint8_t *done, bool *banner)
+{
+  // Clear out anything left over from before the Arduino was reset
+  while(readRaw() != -1) /* nothing */;
 
-  // Always start with disabling verbose mode, otherwise we won't be
-  // able to interpret responses
-  if (!writeCommandCheckOk("ATV0"))
+  // A plain AT first, so a module that is not running is detected
+  // quickly. AT&V can take longer, its output is long.
+  StartupProbe probe = {0, 0, false};
+  writeCommand("AT");
+  bool ok = (readResponse(parse_probe_line, &probe) == GS_SUCCESS);
+  if (ok) {
+    useTimeout(GS_TIMEOUT_FLASH);
+    writeCommand("AT&V");
+    ok = (readResponse(parse_probe_line, &probe) == GS_SUCCESS);
+  }
+  *done = probe.done;
+  *banner = probe.banner;
+  return ok;
+}
+
+bool GSCore::sendSetupCommands(uint8_t done)
+{
+  // Send all commands at once, so this takes only a single round trip
+  // instead of one per command
+  uint8_t sent = 0;
+  for (uint8_t i = 0; i < SETUP_COMMAND_COUNT; ++i) {
+    if (!(done & (1 << i))) {
+      writeCommand(setup_commands[i]);
+      sent++;
+    }
+  }
+  this->startup_stats.commands = sent;
+
+  bool ok = true;
+  while (sent--) {
+    if (readResponse() != GS_SUCCESS)
+      ok = false;
+  }
+  return ok;
+}
+
+bool GSCore::negotiateBaudRate(uint32_t baud, uint32_t current, baud_callback_t callback, void *data)
+{
+  if (!this->serial || this->unrecoverableError)
     return false;
 
-  // Disable echo mode
-  if (!writeCommandCheckOk("ATE0"))
+  // Switching the module cannot be undone when we cannot follow, so
+  // check first
+  if (!callback(data, baud, true)) {
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Baud rate not supported: ");
+      this->error->println(baud);
+    }
     return false;
+  }
 
-  // Enable bulk mode
-  if (!writeCommandCheckOk("AT+BDATA=1"))
+  // Nothing should be in flight while switching
+  if (!flushCommands() || !flushTxFrames())
     return false;
 
-  // Enable enhanced asynchronous messages
-  if (!writeCommandCheckOk("AT+ASYNCMSGFMT=1"))
+  // The module replies at the current rate and switches afterwards
+  if (!writeCommandCheckOk("ATB=%lu", (unsigned long)baud))
     return false;
 
-  memset(this->connections, 0, sizeof(connections));
+  if (callback(data, baud, false) && probeLink())
+    return true;
 
-  return true;
+  if (GS_LOG_ERRORS && this->error) {
+    this->error->print("Switching to baud rate failed: ");
+    this->error->println(baud);
+  }
+
+  // Switch the module back, in case it can still understand us at the
+  // new rate, then go back to the current rate ourselves
+  writeCommand("ATB=%lu", (unsigned long)current);
+  callback(data, current, false);
+  if (probeLink())
+    return false;
+
+  if (GS_LOG_ERRORS && this->error)
+    this->error->println("Module unreachable after switching baud rate");
+  this->unrecoverableError = true;
+  return false;
 }
 
+bool GSCore::probeLink()
+{
+  for (uint8_t tries = 0; tries < 2; ++tries) {
+    // Discard anything garbled by the switch and forget about any
+    // partially parsed escape sequence or response
+    while(readRaw() != -1) /* nothing */;
+    this->rx_state = GS_RX_IDLE;
+    this->rx_response = NULL;
+    this->resync_needed = false;
+
+    if (writeCommandCheckOk("AT"))
+      return true;
+  }
+  this->rx_response = NULL;
+  this->resync_needed = false;
+  return false;
+}
 
 void GSCore::end()
 {
+  setRxInterrupt(false);
   this->serial = NULL;
   if (this->ss_pin != INVALID_PIN)
     pinMode(this->ss_pin, INPUT);
@@ -179,17 +511,76 @@ void GSCore::end()
   this->data_ready_pin = INVALID_PIN;
 
   // Make sure that queries on state still return something sane
-  memset(this->connections, 0, sizeof(connections));
+  memset(this->connections, 0, (this->max_cid + 1) * sizeof(*this->connections));
   this->associated = false;
   unrecoverableError = false;
 }
 
+void GSCore::setPollInterval(uint32_t min, uint32_t max)
+{
+  if (min > max)
+    min = max;
+  this->spi_poll_min = min;
+  this->spi_poll_max = max;
+  if (this->poll_stats.interval < min)
+    this->poll_stats.interval = min;
+  if (this->poll_stats.interval > max)
+    this->poll_stats.interval = max;
+}
+
+bool GSCore::setRxInterrupt(bool enable)
+{
+  if (this->data_ready_pin == INVALID_PIN)
+    return false;
+
+  int irq = digitalPinToInterrupt(this->data_ready_pin);
+  if (irq == NOT_AN_INTERRUPT)
+    return false;
+
+  if (enable) {
+    if (rx_interrupt_instance == this)
+      return true;
+    if (rx_interrupt_instance)
+      return false;
+
+    rx_interrupt_instance = this;
+    // This makes sure the interrupt is disabled during our own (and
+    // other) SPI transactions
+    SPI.usingInterrupt(irq);
+    attachInterrupt(irq, rxInterrupt, RISING);
+    // If the pin is high already, there won't be a rising edge, so
+    // read any data now.
+    pumpSpi();
+  } else if (rx_interrupt_instance == this) {
+    detachInterrupt(irq);
+    SPI.notUsingInterrupt(irq);
+    rx_interrupt_instance = NULL;
+  }
+  return true;
+}
+
 void GSCore::loop()
 {
   if (this->unrecoverableError)
     return;
 
+  if (this->suppressed_errors) {
+    noInterrupts();
+    uint8_t count = this->suppressed_errors;
+    this->suppressed_errors = 0;
+    interrupts();
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Errors suppressed inside the data_ready interrupt: ");
+      this->error->println(count);
+    }
+  }
+
+  drainTx();
+  sendAsyncWrites(false);
   readAndProcessAsync();
+  processCommands();
+  dispatchData();
+  reportTxFrames();
 
   if (this->onNcmDisconnect && (this->events & EVENT_NCM_DISCONNECTED)) {
     this->events &= ~EVENT_NCM_DISCONNECTED;
@@ -216,10 +607,12 @@ void GSCore::loop()
 int GSCore::peekData(cid_t cid)
 {
   // If availableData returns non-zero, then at least one byte is
-  // available in the buffer, so we can just return that without further
+  // available in the queue, so we can just return that without further
   // checking.
-  if (availableData(cid) > 0)
-    return this->rx_data[this->rx_data_tail];
+  if (availableData(cid) > 0) {
+    RXQueue &q = this->rx_queues[cid];
+    return this->rx_data[q.first * RX_BLOCK_SIZE + q.read];
+  }
   return -1;
 }
 
@@ -229,7 +622,10 @@ int GSCore::readData(cid_t cid)
   if (!getFrameHeader(cid))
     return -1;
 
-  return getData();
+  uint8_t c;
+  if (!readFrameData(cid, &c, 1))
+    return -1;
+  return c;
 }
 
 size_t GSCore::readData(cid_t cid, uint8_t *buf, size_t size)
@@ -238,70 +634,78 @@ size_t GSCore::readData(cid_t cid, uint8_t *buf, size_t size)
   if (!getFrameHeader(cid))
     return 0;
 
-  if (this->rx_data_tail != this->rx_data_head) {
-    // There is data in the buffer. Find out how much data we can read
-    // consecutively
-    rx_data_index_t len;
-    if (this->rx_data_head > this->rx_data_tail) {
-      // Data can be read from the tail to the head
-      len = this->rx_data_head - this->rx_data_tail;
-    } else {
-      // Data can be read from the tail to the end of the buffer
-      len = sizeof(this->rx_data) - this->rx_data_tail;
-    }
-    // Don't read beyond the end of the frame
-    if (len > this->tail_frame.length)
-      len = this->tail_frame.length;
-    // Don't write beyond the end of the buffer
-    if (len > size)
-      len = size;
-    memcpy(buf, &this->rx_data[this->rx_data_tail], len);
-    this->rx_data_tail = (this->rx_data_tail + len) % sizeof(this->rx_data);
-    this->tail_frame.length -= len;
-    // If the buffer isn't full yet, call ourselves again to read more
-    // data:
-    //  - From the start of the buffer if we read up to the end of rx_data
-    //  - From a next frame, if we read up to the end of the frame
-    //  - From the module directly, if we emptied rx_data
-    if (len != size)
-      len += readData(cid, buf + len, size - len);
-    return len;
-  } else {
-    // No data buffered, try reading from the module directly, as long
-    // as it keeps sending us data
-    size_t read = 0;
-    while (read < size) {
-      int c = readRaw();
-      if (c == -1)
-        break;
-      buf[read++] = c;
-      this->tail_frame.length--;
-      if(--this->head_frame.length == 0) {
-        this->rx_state = GS_RX_IDLE;
-        break;
-      }
-    }
-    return read;
+  // Keep reading until the buffer is full, reading from the next frame
+  // if we read up to the end of the current frame.
+  size_t read = 0;
+  while (read < size && startFrame(cid)) {
+    uint16_t len = (size - read > 0xffff ? 0xffff : size - read);
+    len = readFrameData(cid, buf + read, len);
+    if (len == 0)
+      break;
+    read += len;
+  }
+  return read;
+}
+
+uint8_t GSCore::peekData(cid_t cid, DataSpan spans[2])
+{
+  // This makes sure the frame is started and at least one byte is
+  // buffered when available
+  if (availableData(cid) == 0)
+    return 0;
+
+  RXQueue &q = this->rx_queues[cid];
+  uint16_t left = q.left;
+  uint8_t block = q.first;
+  uint8_t offset = q.read;
+  uint8_t n = 0;
+  while (n < 2 && left && block != RX_NO_BLOCK) {
+    uint8_t end = (block == q.last ? q.write : RX_BLOCK_SIZE);
+    uint16_t len = end - offset;
+    if (len > left)
+      len = left;
+    if (len == 0)
+      break;
+
+    spans[n].data = &this->rx_data[block * RX_BLOCK_SIZE + offset];
+    spans[n].len = len;
+    left -= len;
+    n++;
+
+    block = (block == q.last ? RX_NO_BLOCK : this->rx_block_next[block]);
+    offset = 0;
   }
+  return n;
+}
+
+void GSCore::consumeData(cid_t cid, uint16_t len)
+{
+  if (cid > this->max_cid)
+    return;
+
+  RXQueue &q = this->rx_queues[cid];
+  if (len > q.left)
+    len = q.left;
+  q.left -= dequeueData(cid, NULL, len);
 }
 
 int GSCore::readData(cid_t *cid)
 {
   // First, make sure we have a valid frame header
-  if (!getFrameHeader(ANY_CID))
+  RXFrame frame = getFrameHeader(ANY_CID);
+  if (!frame)
     return -1;
 
-  int c = getData();
-  if (c >= 0)
-    *cid = this->tail_frame.cid;
+  uint8_t c;
+  if (!readFrameData(frame.cid, &c, 1))
+    return -1;
+  *cid = frame.cid;
   return c;
 }
 
 GSCore::cid_t GSCore::firstCidWithData()
 {
-  if (!getFrameHeader(ANY_CID))
-    return INVALID_CID;
-  return this->tail_frame.cid;
+  return nextCidWithData();
 }
 
 uint16_t GSCore::availableData(cid_t cid)
@@ -324,25 +728,110 @@ uint16_t GSCore::availableData(cid_t cid)
   // available() returns > 0. So we should only return 0 when really is
   // no data available. For this reason, if our buffer is empty, try to
   // read at least one byte from the module.
-  if (this->rx_data_head == this->rx_data_tail)
-    processIncoming(readRaw());
+  if (this->rx_queues[cid].first == RX_NO_BLOCK)
+    pumpIncoming();
 
-  uint16_t len = (this->rx_data_head - this->rx_data_tail) % sizeof(this->rx_data);
-  if (len > this->tail_frame.length)
-    len = this->tail_frame.length;
+  uint16_t len = queuedData(cid);
+  if (len > this->rx_queues[cid].left)
+    len = this->rx_queues[cid].left;
   return len;
 }
 
+GSCore::RxStats GSCore::getRxStats(cid_t cid)
+{
+  RxStats stats;
+  stats.queued = queuedData(cid);
+  stats.dropped_frames = this->rx_queues[cid].dropped_frames;
+  stats.dropped_bytes = this->rx_queues[cid].dropped_bytes;
+  return stats;
+}
+
+void GSCore::setRxBudget(cid_t cid, uint16_t bytes)
+{
+  uint16_t blocks = (bytes + RX_BLOCK_SIZE - 1) / RX_BLOCK_SIZE;
+  if (blocks < 1)
+    blocks = 1;
+  if (blocks > this->rx_block_count)
+    blocks = this->rx_block_count;
+
+  if (cid == ANY_CID) {
+    for (cid = 0; cid <= this->max_cid; ++cid)
+      this->rx_queues[cid].budget = blocks;
+  } else if (cid <= this->max_cid) {
+    this->rx_queues[cid].budget = blocks;
+  }
+}
+
+void GSCore::setOnData(cid_t cid, data_callback_t callback, bool payload)
+{
+  if (cid == ANY_CID) {
+    for (cid = 0; cid <= this->max_cid; ++cid)
+      setOnData(cid, callback, payload);
+  } else if (cid <= this->max_cid) {
+    this->rx_queues[cid].on_data = callback;
+    this->rx_queues[cid].on_data_payload = payload;
+  }
+}
+
 bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
 {
-  if (cid > MAX_CID)
+  DataSpan part = {buf, len};
+  return writeDataV(cid, &part, 1);
+}
+
+bool GSCore::writeDataV(cid_t cid, const DataSpan *parts, uint8_t count)
+{
+  if (cid > this->max_cid)
     return false;
 
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < count; ++i)
+    total += parts[i].len;
+
   // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
-  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
-    return writeData(cid, buf, 1400) && writeData(cid, buf + 1400, len - 1400);
+  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx"),
+  // so split the data into multiple frames if needed
+  uint16_t offset = 0;
+  do {
+    uint16_t len = total > MAX_FRAME_SIZE ? MAX_FRAME_SIZE : total;
+    if (!writeFrameHeader(cid, len))
+      return false;
+    writeParts(&parts, &offset, len);
+    total -= len;
+  } while (total);
+  return true;
+}
+
+uint8_t GSCore::formatUdpHeader(char *header, cid_t cid, IPAddress ip, uint16_t port, uint16_t len)
+{
+  if (GS_DUMP_LINES && this->debug) {
+    this->debug->print(">>| Writing UDP server bulk data frame for cid ");
+    this->debug->print(cid);
+    this->debug->print(" to ");
+    this->debug->print(ip);
+    this->debug->print(":");
+    this->debug->print(port);
+    this->debug->print(" containing ");
+    this->debug->print(len);
+    this->debug->println(" bytes");
+  }
+
+  // <ESC>Y<cid><ip>:<port>:<length, 4 digits>
+  uint8_t headerlen = 0;
+  header[headerlen++] = 0x1b;
+  header[headerlen++] = 'Y';
+  header[headerlen++] = formatHexDigit(cid);
+  headerlen += formatIpAddress(header + headerlen, ip);
+  header[headerlen++] = ':';
+  headerlen += formatNumber(header + headerlen, port);
+  header[headerlen++] = ':';
+  formatLength(header + headerlen, len);
+  headerlen += 4;
+  return headerlen;
+}
 
+bool GSCore::writeFrameHeader(cid_t cid, uint16_t len)
+{
   if (GS_DUMP_LINES && this->debug) {
     this->debug->print(">>| Writing bulk data frame for cid ");
     this->debug->print(cid);
@@ -351,58 +840,99 @@ bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
     this->debug->println(" bytes");
   }
 
-  uint8_t header[8]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  snprintf((char*)header, sizeof(header), "\x1bZ%x%04d", cid, len);
+  // <ESC>Z<cid><length, 4 digits>
+  char header[FRAME_HEADER_SIZE];
+  header[0] = 0x1b;
+  header[1] = 'Z';
+  header[2] = formatHexDigit(cid);
+  formatLength(header + 3, len);
+
+  if (this->tx_pipeline) {
+    // Make sure there is room for another frame in flight, and to
+    // remember it
+    if (!waitTxFrames(this->tx_pipeline - 1))
+      return false;
+    if ((uint8_t)(this->tx_frames_tail - this->tx_frames_head) == TX_PIPELINE_SIZE)
+      reportTxFrames();
+
+    // Remember the frame before writing it, since the module might
+    // acknowledge it while we are still writing the data
+    TxFrame &frame = this->tx_frames[this->tx_frames_tail++ & (TX_PIPELINE_SIZE - 1)];
+    frame.cid = cid;
+    frame.state = GS_TX_FRAME_PENDING;
+    frame.async = false;
+
+    writeRaw((const uint8_t*)header, sizeof(header));
+    return true;
+  }
+
+  // Acknowledgements for pipelined frames would confuse
+  // readDataResponse(), so wait for them first
+  if (!waitTxFrames(0))
+    return false;
+
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
-  writeRaw(header, 3);
+  writeRaw((const uint8_t*)header, 3);
   if (!readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending bulk data frame failed");
     return false;
   }
 
-  // Then, write the rest of the escape sequence (-1 to not write the
-  // trailing 0)
-  writeRaw(header + 3, sizeof(header) - 1 - 3);
-  // And write the actual data
-  writeRaw(buf, len);
+  // Then, write the rest of the escape sequence
+  writeRaw((const uint8_t*)header + 3, sizeof(header) - 3);
   return true;
 }
 
+void GSCore::writeParts(const DataSpan **parts, uint16_t *offset, uint16_t len)
+{
+  while (len) {
+    uint16_t n = (*parts)->len - *offset;
+    if (n > len)
+      n = len;
+    writeRaw((*parts)->data + *offset, n);
+    *offset += n;
+    len -= n;
+    if (*offset == (*parts)->len) {
+      (*parts)++;
+      *offset = 0;
+    }
+  }
+}
+
 bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len)
 {
-  if (cid > MAX_CID)
+  DataSpan part = {buf, len};
+  return writeDataV(cid, ip, port, &part, 1);
+}
+
+bool GSCore::writeDataV(cid_t cid, IPAddress ip, uint16_t port, const DataSpan *parts, uint8_t count)
+{
+  if (cid > this->max_cid)
     return false;
 
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < count; ++i)
+    total += parts[i].len;
+
   // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
   // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
+  if (total > MAX_FRAME_SIZE)
     return false;
+  uint16_t len = total;
 
-  uint8_t ipbuf[16];
-  snprintf((char*)ipbuf, sizeof(ipbuf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-
-  if (GS_DUMP_LINES && this->debug) {
-    this->debug->print(">>| Writing UDP server bulk data frame for cid ");
-    this->debug->print(cid);
-    this->debug->print(" to ");
-    this->debug->print((const char*)ipbuf);
-    this->debug->print(":");
-    this->debug->print(port);
-    this->debug->print(" containing ");
-    this->debug->print(len);
-    this->debug->println(" bytes");
-  }
+  char header[UDP_HEADER_SIZE];
+  uint8_t headerlen = formatUdpHeader(header, cid, ip, port, len);
 
-  uint8_t header[28]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  size_t headerlen = snprintf((char*)header, sizeof(header), "\x1bY%x%s:%u:%04d", cid, ipbuf, port, len);
+  // Acknowledgements for pipelined frames would confuse
+  // readDataResponse(), so wait for them first
+  if (!waitTxFrames(0))
+    return false;
 
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
-  writeRaw(header, 3);
+  writeRaw((const uint8_t*)header, 3);
   if (!readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending UDP server bulk data frame failed");
@@ -410,15 +940,72 @@ bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *bu
   }
 
   // Then, write the rest of the escape sequence
-  writeRaw(header + 3, headerlen - 3);
+  writeRaw((const uint8_t*)header + 3, headerlen - 3);
   // TODO: the rest of the header can trigger an <ESC>F reply (but no
   // <ESC>O if everything is ok...)
 
   // And write the actual data
-  writeRaw(buf, len);
+  uint16_t offset = 0;
+  writeParts(&parts, &offset, len);
+  return true;
+}
+
+uint8_t GSCore::writeDatagrams(cid_t cid, Datagram *datagrams, uint8_t count)
+{
+  uint8_t ok = 0;
+  for (uint8_t i = 0; i < count; ++i) {
+    Datagram &d = datagrams[i];
+    d.ok = writeData(cid, d.ip, d.port, d.data, d.len);
+    if (d.ok)
+      ok++;
+  }
+  return ok;
+}
+
+uint16_t GSCore::writeDataSegmented(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len, uint16_t segment)
+{
+  if (segment == 0 || segment > MAX_FRAME_SIZE)
+    segment = MAX_FRAME_SIZE;
+
+  uint16_t ok = 0;
+  while (len) {
+    uint16_t n = len > segment ? segment : len;
+    if (writeData(cid, ip, port, buf, n))
+      ok++;
+    buf += n;
+    len -= n;
+  }
+  return ok;
+}
+
+bool GSCore::writeDataAsync(cid_t cid, const uint8_t *buf, uint16_t len, write_callback_t callback, void *data)
+{
+  if (cid > this->max_cid || len > MAX_FRAME_SIZE || !this->connections[cid].connected)
+    return false;
+
+  if ((uint8_t)(this->async_tail - this->async_head) == ASYNC_WRITE_QUEUE_SIZE)
+    return false;
+
+  AsyncWrite &w = this->async_writes[this->async_tail++ & (ASYNC_WRITE_QUEUE_SIZE - 1)];
+  w.cid = cid;
+  w.buf = buf;
+  w.len = len;
+  w.sent = 0;
+  w.callback = callback;
+  w.data = data;
+
+  // Get things going, without blocking
+  sendAsyncWrites(false);
   return true;
 }
 
+void GSCore::setTxPipeline(uint8_t depth)
+{
+  if (depth > TX_PIPELINE_SIZE)
+    depth = TX_PIPELINE_SIZE;
+  this->tx_pipeline = depth;
+}
+
 /*******************************************************
  * Methods for writing commands / reading replies
  *******************************************************/
@@ -434,27 +1021,37 @@ void GSCore::writeCommand(const char *fmt, ...)
 
 void GSCore::writeCommand(const char *fmt, va_list args)
 {
-  uint8_t buf[128];
-  size_t len = vsnprintf((char*)buf, sizeof(buf) - 2, fmt, args);
-  if (len > sizeof(buf) - 2) {
-    len = sizeof(buf) - 2;
-    if (GS_LOG_ERRORS && this->error) {
-      this->error->print("Command truncated: ");
-      this->error->write(buf, len);
-      this->error->println();
-    }
+  this->response_timeout = takeTimeout();
+
+  // Queued commands go first, so their responses are not mixed up
+  // with ours
+  flushCommands();
+  resync(true);
+
+  if (GS_DUMP_LINES && this->debug) {
+    va_list copy;
+    va_copy(copy, args);
+    this->debug->print(">>= ");
+    formatCommand(*this->debug, fmt, copy);
+    this->debug->println();
+    va_end(copy);
   }
 
+  CommandWriter writer(this);
+  formatCommand(writer, fmt, args);
+  writer.write((const uint8_t*)"\r\n", 2);
+}
+
+void GSCore::writeCommandLine(const uint8_t *buf, uint16_t len)
+{
   if (GS_DUMP_LINES && this->debug) {
     this->debug->print(">>= ");
     this->debug->write(buf, len);
     this->debug->println();
   }
 
-  buf[len++] = '\r';
-  buf[len++] = '\n';
-
   this->writeRaw(buf, len);
+  this->writeRaw((const uint8_t*)"\r\n", 2);
 }
 
 bool GSCore::writeCommandCheckOk(const char *fmt, ...)
@@ -468,122 +1065,312 @@ bool GSCore::writeCommandCheckOk(const char *fmt, ...)
   return (readResponse() == GS_SUCCESS);
 }
 
-GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+bool GSCore::writeCommandAsync(line_callback_t line_callback, command_callback_t callback, void *data, const char *fmt, ...)
 {
-  uint16_t read = 0;
-  uint16_t line_start = 0;
-  bool dropped_data = false;
-  bool skip_line = false;
-  GSResponse res;
-  unsigned long start = millis();
-  while(true) {
-    if (this->unrecoverableError)
-      return GS_UNRECOVERABLE_ERROR;
+  // Take the timeout even when failing, so it does not apply to the
+  // next command instead
+  uint32_t timeout = takeTimeout();
+  if ((uint8_t)(this->command_tail - this->command_head) == COMMAND_QUEUE_SIZE)
+    return false;
 
-    int c = readRaw();
-    if (c == -1) {
-      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
-        if (GS_LOG_ERRORS && this->error)
-          this->error->println("Response timeout");
-        // On a response timeout, our state will be (and probably stay)
-        // wrong. Flag an unrecoverable error.
-        this->unrecoverableError = true;
-        return GS_UNRECOVERABLE_ERROR;
-      }
-      continue;
-    }
+  // Format the command directly behind the text of the other queued
+  // commands
+  CommandBuffer text(this->command_text + this->command_text_len, COMMAND_TEXT_SIZE - this->command_text_len);
+  va_list args;
+  va_start(args, fmt);
+  formatCommand(text, fmt, args);
+  va_end(args);
+  if (text.getWriteError()) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("No room to queue command");
+    return false;
+  }
+  Command &cmd = this->commands[this->command_tail++ & (COMMAND_QUEUE_SIZE - 1)];
+  cmd.len = text.len;
+  cmd.line_callback = line_callback;
+  cmd.callback = callback;
+  cmd.data = data;
+  cmd.connect_cid = INVALID_CID;
+  cmd.timeout = timeout;
+  this->command_text_len += text.len;
+  return true;
+}
 
-    if (this->rx_state != GS_RX_IDLE || c == 0x1b) {
-      // We're currently handling connection or async data, or are about
-      // to. Let processIncoming sort that out.
-      processIncoming(c);
-    } else if ((c == '\r' || c == '\n')) {
-      // This normalizes all sequences of line endings into a single
-      // \r\n and strips leading \r\n sequences, because responses tend
-      // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
-      // As a side effect, this removes empty lines from output, but
-      // that's ok.
-      if (read - line_start == 0)
-        continue;
+uint32_t GSCore::takeTimeout()
+{
+  uint32_t timeout = this->next_timeout ?: this->next_class_timeout ?: this->timeouts[GS_TIMEOUT_CONFIG];
+  this->next_timeout = this->next_class_timeout = 0;
+  return timeout;
+}
 
-      if (skip_line) {
-        // Data from this line has been dropped because the buffer was
-        // full, and it was too long for a response anyway, so further
-        // ignore this line.
-        skip_line = false;
-        // Remove the line from the buffer
-        read = line_start;
-        if (GS_DUMP_LINES && this->debug)
-          this->debug->println("<<| Skipped uninteresting long line");
-        continue;
+GSCore::GSResponse GSCore::responseTimeout(uint32_t timeout)
+{
+  if (GS_LOG_ERRORS && this->error)
+    this->error->println("Response timeout");
+
+  // The response might still arrive, or it might have been lost. To
+  // make sure it is not mistaken for the response to the next command,
+  // skip all responses until resync() finished.
+  this->resync_needed = true;
+  this->resync_sent = false;
+  uint32_t min = this->timeouts[GS_TIMEOUT_CONFIG];
+  this->resync_timeout = (timeout > min ? timeout : min);
+  startResponse(&this->late_response, this->late_line, sizeof(this->late_line), NULL, false, NULL, NULL);
+  return GS_RESPONSE_TIMEOUT;
+}
+
+bool GSCore::resync(bool block)
+{
+  while (this->resync_needed) {
+    if (this->unrecoverableError)
+      return false;
+
+    unsigned long now = millis();
+    if (!this->resync_sent) {
+      writeCommandLine((const uint8_t*)"AT", 2);
+      this->resync_sent = true;
+      this->resync_seen = false;
+      this->resync_time = now;
+    } else if (this->resync_seen) {
+      if ((unsigned long)(now - this->resync_time) > RESYNC_QUIET_TIME) {
+        this->resync_needed = false;
+        this->resync_failures = 0;
+        if (this->rx_response == &this->late_response)
+          this->rx_response = NULL;
+        return true;
       }
-      skip_line = false;
-
-      res = processResponseLine(buf + line_start, read - line_start, connect_cid);
-      // When we get a GS_LINK_LOST, we're apparently not associated
-      // when we thought we would be. Call processDisassciation() to fix
-      // that.
-      if (res == GS_LINK_LOST)
-        processDisassociation();
-
-      if (keep_data && !callback && !dropped_data && res == GS_UNKNOWN_RESPONSE) {
-        // Unknown response, so it's probably actual data that the
-        // caller will want to have. Leave it in the buffer, and
-        // terminate it with \r\n.
-        if (read < *len) buf[read++] = '\r';
-        if (read < *len) buf[read++] = '\n';
-        line_start = read;
-      } else {
-        // If we have a callback, pass any unknown response to it
-        if (keep_data && callback && res == GS_UNKNOWN_RESPONSE)
-          callback(&buf[line_start], read - line_start, data);
-
-        // Remove the line from the buffer since we either handled it
-        // already, or we're not interested in the data
-        read = line_start;
-
-        if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
-          // All other responses indicate the end of the reply
-          *len = read;
-          return res;
+    } else if ((unsigned long)(now - this->resync_time) > this->resync_timeout) {
+      if (++this->resync_failures == MAX_RESYNC_ATTEMPTS) {
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println("Response timeout, module not responding");
+        // Our state will be (and probably stay) wrong. Flag an
+        // unrecoverable error.
+        this->unrecoverableError = true;
+        this->rx_response = NULL;
+        return false;
+      }
+      // Try again
+      this->resync_sent = false;
+      continue;
+    }
+
+    if (!block)
+      return false;
+    processIncoming(readRaw());
+  }
+  return true;
+}
+
+bool GSCore::flushCommands()
+{
+  while (this->command_head != this->command_tail) {
+    if (this->unrecoverableError)
+      return false;
+
+    processIncoming(readRaw());
+    processCommands();
+  }
+  return true;
+}
+
+void GSCore::processCommands()
+{
+  if (this->command_sent) {
+    Command &cmd = this->commands[this->command_head & (COMMAND_QUEUE_SIZE - 1)];
+    GSResponse res = this->command_response.res;
+    if (res == GS_UNKNOWN_RESPONSE) {
+      if ((unsigned long)(millis() - this->command_start) <= cmd.timeout)
+        return;
+
+      res = responseTimeout(cmd.timeout);
+    }
+
+    // Remove the command from the queue before calling the callback,
+    // which might queue another command
+    this->command_sent = false;
+    this->command_head++;
+    if (cmd.callback)
+      cmd.callback(cmd.data, res, cmd.connect_cid);
+  }
+
+  // Send the next command, unless the callback did so already, or a
+  // blocking command is reading its response
+  if (this->command_sent || this->command_head == this->command_tail || this->unrecoverableError)
+    return;
+  if (this->rx_response && this->rx_response != &this->late_response)
+    return;
+  if (!resync(false))
+    return;
+
+  Command &cmd = this->commands[this->command_head & (COMMAND_QUEUE_SIZE - 1)];
+  startResponse(&this->command_response, this->command_line, sizeof(this->command_line), &cmd.connect_cid, cmd.line_callback != NULL, cmd.line_callback, cmd.data);
+  this->command_sent = true;
+  this->command_start = millis();
+  writeCommandLine(this->command_text, cmd.len);
+
+  // Remove the text that was just sent
+  this->command_text_len -= cmd.len;
+  memmove(this->command_text, this->command_text + cmd.len, this->command_text_len);
+}
+
+void GSCore::startResponse(ResponseState *state, uint8_t *buf, uint16_t len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  state->buf = buf;
+  state->size = len;
+  state->read = 0;
+  state->line_start = 0;
+  state->connect_cid = connect_cid;
+  state->keep_data = keep_data;
+  state->callback = callback;
+  state->data = data;
+  state->dropped_data = false;
+  state->skip_line = false;
+  state->res = GS_UNKNOWN_RESPONSE;
+
+  // When a line was partially received already (the response to a
+  // command that timed out), continue it
+  ResponseState *prev = this->rx_response;
+  if (prev && prev != state) {
+    uint16_t partial = prev->read - prev->line_start;
+    if (partial > len) {
+      partial = len;
+      state->skip_line = true;
+    }
+    memcpy(buf, prev->buf + prev->line_start, partial);
+    state->read = partial;
+    state->skip_line |= prev->skip_line;
+  }
+  this->rx_response = state;
+}
+
+GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  ResponseState state;
+  startResponse(&state, buf, *len, connect_cid, keep_data, callback, data);
+
+  // Bytes are passed to processResponseByte() by processIncoming()
+  unsigned long start = millis();
+  while(state.res == GS_UNKNOWN_RESPONSE) {
+    if (this->unrecoverableError) {
+      this->rx_response = NULL;
+      return GS_UNRECOVERABLE_ERROR;
+    }
+
+    if (!processIncoming(readRaw()) && (unsigned long)(millis() - start) > this->response_timeout) {
+      *len = 0;
+      return responseTimeout(this->response_timeout);
+    }
+  }
+
+  *len = state.read;
+  return state.res;
+}
+
+void GSCore::processResponseByte(ResponseState *state, uint8_t c)
+{
+  uint8_t *buf = state->buf;
+  if ((c == '\r' || c == '\n')) {
+    // This normalizes all sequences of line endings into a single
+    // \r\n and strips leading \r\n sequences, because responses tend
+    // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
+    // As a side effect, this removes empty lines from output, but
+    // that's ok.
+    if (state->read - state->line_start == 0)
+      return;
+
+    if (state->skip_line) {
+      // Data from this line has been dropped because the buffer was
+      // full, and it was too long for a response anyway, so further
+      // ignore this line.
+      state->skip_line = false;
+      // Remove the line from the buffer
+      state->read = state->line_start;
+      if (GS_DUMP_LINES && this->debug)
+        this->debug->println("<<| Skipped uninteresting long line");
+      return;
+    }
+
+    // Lines that belong to the response to a command that timed out
+    // are skipped
+    bool late = (state == &this->late_response);
+    GSResponse res = processResponseLine(buf + state->line_start, state->read - state->line_start, late ? NULL : state->connect_cid);
+    // When we get a GS_LINK_LOST, we're apparently not associated
+    // when we thought we would be. Call processDisassciation() to fix
+    // that.
+    if (res == GS_LINK_LOST)
+      processDisassociation();
+
+    if (late) {
+      state->read = state->line_start;
+      if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
+        if (GS_DUMP_LINES && this->debug)
+          this->debug->println("<<| Skipped late response");
+        // See resync()
+        if (this->resync_sent) {
+          this->resync_seen = true;
+          this->resync_time = millis();
         }
       }
+      return;
+    }
+
+    if (state->keep_data && !state->callback && !state->dropped_data && res == GS_UNKNOWN_RESPONSE) {
+      // Unknown response, so it's probably actual data that the
+      // caller will want to have. Leave it in the buffer, and
+      // terminate it with \r\n.
+      if (state->read < state->size) buf[state->read++] = '\r';
+      if (state->read < state->size) buf[state->read++] = '\n';
+      state->line_start = state->read;
+    } else {
+      // If we have a callback, pass any unknown response to it
+      if (state->keep_data && state->callback && res == GS_UNKNOWN_RESPONSE)
+        state->callback(&buf[state->line_start], state->read - state->line_start, state->data);
+
+      // Remove the line from the buffer since we either handled it
+      // already, or we're not interested in the data
+      state->read = state->line_start;
+
+      if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
+        // All other responses indicate the end of the reply
+        state->res = res;
+        this->rx_response = NULL;
+      }
+    }
+  } else {
+    if (state->read < state->size) {
+      buf[state->read++] = c;
+    } else if ((state->read - state->line_start) >= MAX_RESPONSE_SIZE ) {
+      // The buffer is full. However, the line is too long for a
+      // response, so there is no danger in just discarding the byte.
+      if (state->keep_data && GS_LOG_ERRORS && this->error)
+        dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
+
+      // Make sure we won't try to parse the few bytes we have as a
+      // response.
+      state->skip_line = true;
+      state->dropped_data = true;
     } else {
-      if (read < *len) {
-        buf[read++] = c;
-      } else if ((read - line_start) >= MAX_RESPONSE_SIZE ) {
-        // The buffer is full. However, the line is too long for a
-        // response, so there is no danger in just discarding the byte.
-        if (keep_data && GS_LOG_ERRORS && this->error)
-          dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
-
-        // Make sure we won't try to parse the few bytes we have as a
-        // response.
-        skip_line = true;
-        dropped_data = true;
+      // The buffer is full, but we can't just discard the byte: It
+      // might be part of the final response we're waiting for.
+      // Instead, drop the last byte of the previous line to make
+      // room, and move any data in the current line accordingly.
+      if (state->line_start > 0) {
+        if (state->keep_data && GS_LOG_ERRORS && this->error)
+          dump_byte(this->error, "Response buffer too small, removed byte: ", buf[state->line_start - 1]);
+        memmove(&buf[state->line_start - 1], &buf[state->line_start], (state->read - state->line_start));
+        state->line_start--;
+        buf[state->read - 1] = c;
       } else {
-        // The buffer is full, but we can't just discard the byte: It
-        // might be part of the final response we're waiting for.
-        // Instead, drop the last byte of the previous line to make
-        // room, and move any data in the current line accordingly.
-        if (line_start > 0) {
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer too small, removed byte: ", buf[line_start - 1]);
-          memmove(&buf[line_start - 1], &buf[line_start], (read - line_start));
-          line_start--;
-          buf[read] = c;
-        } else {
-          // line_start == 0 should only happen if len <
-          // MAX_RESPONSE_SIZE, but better be safe than sorry.
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer tiny? Dropped byte: ", c);
-        }
-
-        // Once we threw away a byte of data, don't store any new ones
-        // (to make sure the returned data is cleanly truncated instead
-        // of having gaps).
-        dropped_data = true;
+        // line_start == 0 should only happen if len <
+        // MAX_RESPONSE_SIZE, but better be safe than sorry.
+        if (state->keep_data && GS_LOG_ERRORS && this->error)
+          dump_byte(this->error, "Response buffer tiny? Dropped byte: ", c);
       }
+
+      // Once we threw away a byte of data, don't store any new ones
+      // (to make sure the returned data is cleanly truncated instead
+      // of having gaps).
+      state->dropped_data = true;
     }
   }
 }
@@ -608,11 +1395,17 @@ GSCore::GSResponse GSCore::readResponse(line_callback_t callback, void *data, ci
 
 bool GSCore::readDataResponse()
 {
+  // Data that does not fit must not keep us from reading the reply
+  this->rx_waiting = true;
+
+  bool res;
   unsigned long start = millis();
   while(true) {
     int c = readRaw();
-    if (this->unrecoverableError)
-      return false;
+    if (this->unrecoverableError) {
+      res = false;
+      break;
+    }
 
     if (c == -1) {
       if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
@@ -621,7 +1414,8 @@ bool GSCore::readDataResponse()
         // On a response timeout, our state will be (and probably stay)
         // wrong. Flag an unrecoverable error.
         this->unrecoverableError = true;
-        return false;
+        res = false;
+        break;
       }
       continue;
     }
@@ -630,39 +1424,315 @@ bool GSCore::readDataResponse()
       if (GS_DUMP_LINES && this->debug)
         this->debug->println("<<| Read data OK response");
       this->rx_state = GS_RX_IDLE;
-      return true;
+      res = true;
+      break;
     } else if (this->rx_state == GS_RX_ESC && c == 'F') {
       if (GS_DUMP_LINES && this->debug)
         this->debug->println("<<| Read data FAIL response");
       this->rx_state = GS_RX_IDLE;
-      return false;
+      res = false;
+      break;
     } else {
       processIncoming(c);
     }
   }
+  this->rx_waiting = false;
+  return res;
 }
 
+bool GSCore::waitTxFrames(uint8_t max_pending)
+{
+  // A partially written frame will never be acknowledged
+  sendAsyncWrites(true);
+
+  unsigned long start = millis();
+  while ((uint8_t)(this->tx_frames_tail - this->tx_frames_acked) > max_pending) {
+    if (this->unrecoverableError)
+      return false;
 
-uint8_t GSCore::transferSpi(uint8_t out)
+    if (!processIncoming(readRaw()) && (unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println("Data response timeout");
+      // On a response timeout, our state will be (and probably stay)
+      // wrong. Flag an unrecoverable error.
+      this->unrecoverableError = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+void GSCore::reportTxFrames()
 {
-  // Note that we need to toggle SS for every byte, otherwise the module
-  // will ignore subsequent bytes and return 0xff
+  while (this->tx_frames_head != this->tx_frames_acked) {
+    TxFrame &frame = this->tx_frames[this->tx_frames_head++ & (TX_PIPELINE_SIZE - 1)];
+    bool ok = (frame.state == GS_TX_FRAME_OK);
+    if (frame.async) {
+      // Asynchronous writes are acknowledged in order as well
+      AsyncWrite &w = this->async_writes[this->async_head++ & (ASYNC_WRITE_QUEUE_SIZE - 1)];
+      if (w.callback)
+        w.callback(w.data, frame.cid, ok);
+    } else if (this->onTxFrame) {
+      this->onTxFrame(this->eventData, frame.cid, ok);
+    }
+  }
+}
+
+void GSCore::sendAsyncWrites(bool finish)
+{
+  // Prevent recursion through writeRaw() and waitTxFrames()
+  if (this->async_sending)
+    return;
+  this->async_sending = true;
+
+  uint16_t budget = ASYNC_WRITE_BUDGET;
+  while (this->async_send != this->async_tail && !this->unrecoverableError) {
+    AsyncWrite &w = this->async_writes[this->async_send & (ASYNC_WRITE_QUEUE_SIZE - 1)];
+    if (w.sent == 0) {
+      // Starting a new frame, which needs room in tx_frames
+      if ((uint8_t)(this->tx_frames_tail - this->tx_frames_head) == TX_PIPELINE_SIZE) {
+        if (!finish || !waitTxFrames(TX_PIPELINE_SIZE - 1))
+          break;
+        reportTxFrames();
+      }
+
+      // When the connection was closed since the write was queued, the
+      // module would refuse the frame and interpret the rest of it as
+      // commands. Fail the write without sending it instead, after the
+      // frames before it were acknowledged, to keep them in order.
+      bool connected = this->connections[w.cid].connected;
+      if (!connected && this->tx_frames_acked != this->tx_frames_tail) {
+        if (!finish || !waitTxFrames(0))
+          break;
+      }
+
+      TxFrame &frame = this->tx_frames[this->tx_frames_tail++ & (TX_PIPELINE_SIZE - 1)];
+      frame.cid = w.cid;
+      frame.state = GS_TX_FRAME_PENDING;
+      frame.async = true;
+
+      if (!connected) {
+        frame.state = GS_TX_FRAME_FAILED;
+        this->tx_frames_acked++;
+        this->tx_frames_failed++;
+        this->async_send++;
+        continue;
+      }
+
+      if (GS_DUMP_LINES && this->debug) {
+        this->debug->print(">>| Writing asynchronous bulk data frame for cid ");
+        this->debug->print(w.cid);
+        this->debug->print(" containing ");
+        this->debug->print(w.len);
+        this->debug->println(" bytes");
+      }
+    }
+
+    if (!sendAsyncWrite(w, finish, &budget))
+      break;
+    this->async_send++;
+  }
+
+  this->async_sending = false;
+}
+
+bool GSCore::sendAsyncWrite(AsyncWrite &w, bool finish, uint16_t *budget)
+{
+  uint16_t total = FRAME_HEADER_SIZE + w.len;
+  while (w.sent < total) {
+    if (this->unrecoverableError)
+      return false;
+
+    // Find the next consecutive piece to write, from either the header
+    // or the data
+    char header[FRAME_HEADER_SIZE];
+    const uint8_t *piece;
+    uint16_t len;
+    if (w.sent < FRAME_HEADER_SIZE) {
+      header[0] = 0x1b;
+      header[1] = 'Z';
+      header[2] = formatHexDigit(w.cid);
+      formatLength(header + 3, w.len);
+      piece = (const uint8_t*)header + w.sent;
+      len = FRAME_HEADER_SIZE - w.sent;
+    } else {
+      piece = w.buf + (w.sent - FRAME_HEADER_SIZE);
+      len = total - w.sent;
+    }
+
+    if (!finish) {
+      if (*budget == 0)
+        return false;
+      if (len > *budget)
+        len = *budget;
+
+      if (this->ss_pin != INVALID_PIN) {
+        if (this->tx_queue_head != this->tx_queue_tail || this->spi_xoff) {
+          // The module is not ready, so queue what we can without
+          // waiting
+          drainTx();
+          len = queueTx(piece, len);
+          if (len == 0)
+            return false;
+          w.sent += len;
+          *budget -= len;
+          continue;
+        }
+        // The module is ready, so this is sent directly
+        if (len > SPI_BLOCK_SIZE)
+          len = SPI_BLOCK_SIZE;
+      }
+      *budget -= len;
+    }
+
+    writeRaw(piece, len);
+    w.sent += len;
+  }
+  return true;
+}
+
+uint8_t GSCore::transferSpi(const uint8_t *out, uint8_t *in, uint8_t len)
+{
+  uint8_t i = 0;
   SPI.beginTransaction(this->spi_settings);
-  digitalWrite(this->ss_pin, LOW);
-  uint8_t in = SPI.transfer(out);
-  digitalWrite(this->ss_pin, HIGH);
+
+  bool burst = this->spi_burst;
+  if (burst && this->spi_burst_fallback) {
+    if ((unsigned long)(millis() - this->spi_burst_fallback_start) < SPI_BURST_RETRY_INTERVAL)
+      burst = false;
+    else
+      this->spi_burst_fallback = false;
+  }
+
+  if (burst) {
+    digitalWrite(this->ss_pin, LOW);
+    for (i = 0; i < len; ++i)
+      in[i] = SPI.transfer(out[i]);
+    digitalWrite(this->ss_pin, HIGH);
+
+    // Some modules need SS to be toggled for every byte, otherwise they
+    // will ignore subsequent bytes and return 0xff. Since the module
+    // never sends an unescaped 0xff otherwise, a valid byte followed by
+    // only 0xff means that the module ignored everything from there on.
+    // In that case, transfer the ignored bytes again below and stop
+    // using burst mode for a while. A single 0xff followed by valid
+    // bytes is not a sign of this (and the module did receive those
+    // bytes, so they must not be sent again).
+    i = len;
+    if (in[0] != SPI_SPECIAL_ALL_ONE) {
+      while (i > 1 && in[i - 1] == SPI_SPECIAL_ALL_ONE)
+        --i;
+      if (i < len) {
+        if (GS_LOG_ERRORS && canLogError())
+          this->error->println("SPI burst transfer ignored, toggling SS for every byte for a while");
+        this->spi_burst_fallback = true;
+        this->spi_burst_fallback_start = millis();
+      }
+    }
+  }
+
+  for (; i < len; ++i) {
+    digitalWrite(this->ss_pin, LOW);
+    in[i] = SPI.transfer(out[i]);
+    digitalWrite(this->ss_pin, HIGH);
+  }
+
+  if (GS_DUMP_SPI && this->debug && !this->in_interrupt) {
+    for (i = 0; i < len; ++i) {
+      if (in[i] != SPI_SPECIAL_IDLE || out[i] != SPI_SPECIAL_IDLE) {
+        dump_byte(this->debug, "SPI: >> ", out[i], false);
+        dump_byte(this->debug, " << ", in[i]);
+      }
+    }
+  }
+
+  // Process the received bytes before ending the transaction. This
+  // prevents the rx interrupt from putting newer bytes in spi_rx_buf
+  // before these.
+  len = processSpiIncoming(in, len);
   SPI.endTransaction();
-  if (GS_DUMP_SPI && this->debug) {
-    if (in != SPI_SPECIAL_IDLE || out != SPI_SPECIAL_IDLE) {
-      dump_byte(this->debug, "SPI: >> ", out, false);
-      dump_byte(this->debug, " << ", in);
+  return len;
+}
+
+uint8_t GSCore::processSpiIncoming(uint8_t *in, uint8_t len)
+{
+  uint8_t data[2 * SPI_BLOCK_SIZE];
+  uint8_t removed = 0;
+  len = decodeSpi(in, len, data);
+  for (uint8_t i = 0; i < len; ++i) {
+    uint8_t next_head = (this->spi_rx_head + 1) & (this->spi_rx_buf_size - 1);
+    if (next_head == this->spi_rx_tail) {
+      // No room left, so remove the oldest byte
+      in[removed++] = this->spi_rx_buf[this->spi_rx_tail];
+      this->spi_rx_tail = (this->spi_rx_tail + 1) & (this->spi_rx_buf_size - 1);
     }
+    this->spi_rx_buf[this->spi_rx_head] = data[i];
+    this->spi_rx_head = next_head;
   }
-  return in;
+  return removed;
+}
+
+void GSCore::pumpSpi()
+{
+  if (this->unrecoverableError)
+    return;
+
+  uint8_t out[SPI_BLOCK_SIZE];
+  uint8_t in[SPI_BLOCK_SIZE];
+  memset(out, SPI_SPECIAL_IDLE, sizeof(out));
+
+  // Keep reading while the data_ready pin is high, but stop when only
+  // idle bytes are read (see readRaw for why 64 tries are needed) or
+  // when there might not be room for two full blocks anymore. We must
+  // never let processSpiIncoming remove data here, since we can't
+  // process it from within an interrupt. Also, this makes sure that
+  // there is always room for one more block afterwards, which readRaw
+  // relies on.
+  uint8_t tries = 64;
+  while (tries > 0 && digitalRead(this->data_ready_pin)) {
+    uint8_t free = (this->spi_rx_tail - this->spi_rx_head - 1) & (this->spi_rx_buf_size - 1);
+    if (free < 2 * sizeof(in))
+      break;
+
+    uint8_t head = this->spi_rx_head;
+    transferSpi(out, in, sizeof(in));
+    if (head == this->spi_rx_head)
+      tries = (tries > sizeof(in) ? tries - sizeof(in) : 0);
+    else
+      tries = 64;
+  }
+}
+
+GSCore *GSCore::rx_interrupt_instance = NULL;
+
+void GSCore::rxInterrupt()
+{
+  if (rx_interrupt_instance) {
+    rx_interrupt_instance->in_interrupt = true;
+    rx_interrupt_instance->pumpSpi();
+    rx_interrupt_instance->in_interrupt = false;
+  }
+}
+
+bool GSCore::canLogError()
+{
+  if (!this->error)
+    return false;
+  if (this->in_interrupt) {
+    if (this->suppressed_errors < 0xff)
+      this->suppressed_errors++;
+    return false;
+  }
+  return true;
 }
 
 void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
 {
+  // Queued asynchronous writes go first, so a partially written frame
+  // is not interrupted and data stays in order.
+  if (this->async_send != this->async_tail && !this->async_sending)
+    sendAsyncWrites(true);
+
   if (this->serial) {
     if (this->unrecoverableError)
       return;
@@ -671,32 +1741,127 @@ void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
         dump_byte(this->debug, ">= ", buf[i]);
     }
     this->serial->write(buf, len);
-  } else if (this->ss_pin) {
+  } else if (this->ss_pin != INVALID_PIN) {
+    // Previously queued data must be sent first
+    drainTx();
+
     uint16_t tries = 1024; // max 1k per loop
-    while (len && tries > 0) {
+    while (len) {
       if (this->unrecoverableError)
         return;
-      if (this->spi_xoff) {
-        // Module sent XOFF, so send IDLE bytes until it reports it has
-        // buffer space again.
-        tries--;
-        processIncoming(processSpiSpecial(transferSpi(SPI_SPECIAL_IDLE)));
-      } else {
-        if (GS_DUMP_BYTES && this->debug)
-          dump_byte(this->debug, ">= ", *buf);
-        if (isSpiSpecial(*buf)) {
-          processIncoming(processSpiSpecial(transferSpi(SPI_SPECIAL_ESC)));
-          processIncoming(processSpiSpecial(transferSpi(*buf ^ SPI_ESC_XOR)));
-        } else {
-          processIncoming(processSpiSpecial(transferSpi(*buf)));
+
+      if (this->tx_queue_head == this->tx_queue_tail && !this->spi_xoff) {
+        // Nothing queued and the module accepts data, so send directly.
+        // Note that XOFF is only checked between blocks, so the module
+        // might receive up to 2 * SPI_BLOCK_SIZE bytes after sending
+        // XOFF.
+        uint8_t chunk = (len < SPI_BLOCK_SIZE ? len : SPI_BLOCK_SIZE);
+        writeSpi(buf, chunk);
+        buf += chunk;
+        len -= chunk;
+        continue;
+      }
+
+      // Module sent XOFF, so queue as much as possible for later
+      uint16_t queued = queueTx(buf, len);
+      buf += queued;
+      len -= queued;
+      if (!len)
+        break;
+
+      // The queue is full, so we'll have to wait for the module to
+      // report it has buffer space again. readRaw() sends queued data
+      // whenever it can, any data received is processed meanwhile.
+      if (tries-- == 0) {
+        if (GS_LOG_ERRORS && this->error) {
+          this->error->print("SPI transmit queue full, dropped bytes: ");
+          this->error->println(len);
         }
-        buf++;
-        len--;
+        this->tx_dropped += len;
+        return;
       }
+      processIncoming(readRaw());
+    }
+  }
+}
+
+void GSCore::writeSpi(const uint8_t *buf, uint8_t len)
+{
+  uint8_t out[2 * SPI_BLOCK_SIZE];
+  uint8_t in[2 * SPI_BLOCK_SIZE];
+
+  if (GS_DUMP_BYTES && this->debug) {
+    for (uint8_t i = 0; i < len; ++i)
+      dump_byte(this->debug, ">= ", buf[i]);
+  }
+  uint8_t n = encodeSpi(buf, len, out);
+  n = transferSpi(out, in, n);
+  processIncoming(in, n);
+  this->tx_sent += len;
+}
+
+uint16_t GSCore::queueTx(const uint8_t *buf, uint16_t len)
+{
+  uint16_t queued = 0;
+  while (queued < len) {
+    uint8_t next_head = (this->tx_queue_head + 1) & (this->tx_queue_size - 1);
+    if (next_head == this->tx_queue_tail)
+      break;
+    this->tx_queue[this->tx_queue_head] = buf[queued++];
+    this->tx_queue_head = next_head;
+  }
+  return queued;
+}
+
+void GSCore::drainTx()
+{
+  while (this->tx_queue_head != this->tx_queue_tail) {
+    if (this->unrecoverableError)
+      return;
+
+    // Stop when a block of received data might not fit in spi_rx_buf.
+    // Pushing bytes out of spi_rx_buf here would process them before
+    // any bytes our caller is reading with readRaw().
+    uint8_t free = (this->spi_rx_tail - this->spi_rx_head - 1) & (this->spi_rx_buf_size - 1);
+    if (free < 2 * SPI_BLOCK_SIZE)
+      return;
+
+    if (this->spi_xoff) {
+      // Send an idle byte to see if the module sent XON yet
+      uint8_t out = SPI_SPECIAL_IDLE;
+      uint8_t in;
+      if (transferSpi(&out, &in, 1))
+        processIncoming(in);
+      if (this->spi_xoff)
+        return;
     }
+
+    // Send data up to the head or the end of the buffer, whichever
+    // comes first.
+    uint8_t len;
+    if (this->tx_queue_head > this->tx_queue_tail)
+      len = this->tx_queue_head - this->tx_queue_tail;
+    else
+      len = this->tx_queue_size - this->tx_queue_tail;
+    if (len > SPI_BLOCK_SIZE)
+      len = SPI_BLOCK_SIZE;
+
+    writeSpi(&this->tx_queue[this->tx_queue_tail], len);
+    this->tx_queue_tail = (this->tx_queue_tail + len) & (this->tx_queue_size - 1);
   }
 }
 
+GSCore::TxStats GSCore::getTxStats()
+{
+  TxStats stats;
+  stats.queued = (this->tx_queue_head - this->tx_queue_tail) & (this->tx_queue_size - 1);
+  stats.sent = this->tx_sent;
+  stats.dropped = this->tx_dropped;
+  stats.frames_pending = this->tx_frames_tail - this->tx_frames_acked;
+  stats.frames_failed = this->tx_frames_failed;
+  return stats;
+}
+
 int GSCore::readRaw()
 {
   int c;
@@ -707,13 +1872,28 @@ int GSCore::readRaw()
     if (GS_DUMP_BYTES && this->debug)
       dump_byte(this->debug, "<= ", c);
   } else if (this->ss_pin != INVALID_PIN) {
+    // Try to send any queued data. Usually, our caller is waiting for a
+    // reply to it.
+    if (this->spi_rx_head == this->spi_rx_tail)
+      drainTx();
+
+    if (rxBlocked())
+      return -1;
+
+    // Return any bytes received during a previous transfer first
+    if (this->spi_rx_head != this->spi_rx_tail) {
+      c = this->spi_rx_buf[this->spi_rx_tail];
+      this->spi_rx_tail = (this->spi_rx_tail + 1) & (this->spi_rx_buf_size - 1);
+      return c;
+    }
 
     // When the data ready pin (GPIO28) is low, there is no point in
     // trying to read, we'll read idle bytes for sure.
     if (this->data_ready_pin != INVALID_PIN && !digitalRead(this->data_ready_pin))
       return -1;
 
-    int tries;
+    uint8_t tries;
+    bool full_poll = false;
     if (this->data_ready_pin != INVALID_PIN) {
       // If the data ready pin is high, the documentation says we should
       // just keep reading until the pin goes low. In practice, it turns
@@ -742,93 +1922,384 @@ int GSCore::readRaw()
       // it's unlikely that new data is available when there wasn't any
       // a few microseconds ago, we should be smart about when to do a
       // full poll.
-      uint16_t new_time = micros();
-      uint16_t diff = new_time - this->spi_poll_time;
-      if (diff < MINIMUM_POLL_INTERVAL) {
+      uint32_t interval = this->poll_stats.interval;
+      uint32_t new_time = micros();
+      uint32_t diff = new_time - this->spi_poll_time;
+      if (diff < interval) {
         // We recently did polling, so no need to do a full poll.
         // However, we'll always read at least one byte, so that when we
         // get called continously, new data can arrive before
-        // MINIMUM_POLL_INTERVAL has passed.
+        // the poll interval has passed.
         tries = 1;
 
         // Update the the poll timestamp. even though we didn't do a
         // full poll now, we read 1/64th of a full poll, so progress the
         // timestamp by that amount (taking care to not progress it past
         // the current timestamp).
-        if (diff < MINIMUM_POLL_INTERVAL / 64)
+        if (diff < interval / 64)
           this->spi_poll_time = new_time;
         else
-          this->spi_poll_time += (MINIMUM_POLL_INTERVAL / 64);
+          this->spi_poll_time += (interval / 64);
       } else {
         // We haven't done enough polling recently, so do a full poll
         // now.
         tries = 64;
+        full_poll = true;
         this->spi_poll_time = new_time;
+        this->poll_stats.full_polls++;
+      }
+    }
+
+    // Read idle bytes in blocks, until we get some data. Any data
+    // received after the first byte is kept in spi_rx_buf.
+    uint8_t out[SPI_BLOCK_SIZE];
+    uint8_t in[SPI_BLOCK_SIZE];
+    memset(out, SPI_SPECIAL_IDLE, sizeof(out));
+    while (this->spi_rx_head == this->spi_rx_tail && tries > 0) {
+      // Since spi_rx_buf was empty and the rx interrupt always leaves
+      // room for a full block, transferSpi never returns any bytes
+      // here.
+      uint8_t n = (tries < sizeof(out) ? tries : sizeof(out));
+      transferSpi(out, in, n);
+      tries -= n;
+    }
+
+    if (this->data_ready_pin == INVALID_PIN) {
+      // Adapt the poll interval: poll more often while data keeps
+      // coming in and back off exponentially when there is none.
+      uint32_t interval = this->poll_stats.interval;
+      if (this->spi_rx_head != this->spi_rx_tail) {
+        interval /= 2;
+        if (interval < this->spi_poll_min)
+          interval = this->spi_poll_min;
+      } else if (full_poll) {
+        this->poll_stats.idle_polls++;
+        interval = (interval > this->spi_poll_max / 2 ? this->spi_poll_max : interval * 2);
+      }
+      this->poll_stats.interval = interval;
+    }
+
+    if (this->spi_rx_head == this->spi_rx_tail)
+      return -1;
+
+    c = this->spi_rx_buf[this->spi_rx_tail];
+    this->spi_rx_tail = (this->spi_rx_tail + 1) & (this->spi_rx_buf_size - 1);
+  } else {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Begin() not called!");
+    return -1;
+  }
+  return c;
+}
+
+/*******************************************************
+ * Helper methods
+ *******************************************************/
+
+bool GSCore::parseIpAddress(IPAddress *ip, const char *str, uint16_t len)
+{
+  *ip = (uint32_t)0;
+  int i = 0;
+  const char *end = (len ? str + len : NULL);
+  for (const char *p = str; *p && (end == NULL || p < end); ++p) {
+    if (*p == '.') {
+      ++i;
+      if (i >= 4)
+        return false;
+
+      (*ip)[i] = 0;
+      continue;
+    }
+
+    if (*p < '0' || *p > '9')
+      return false;
+
+    if ((*ip)[i] >= 100 || ((*ip)[i] == 25 && *p > '5'))
+      return false;
+
+    (*ip)[i] *= 10;
+    (*ip)[i] += (*p - '0');
+  }
+  return true;
+}
+
+uint8_t GSCore::formatIpAddress(char *dst, const IPAddress &ip)
+{
+  char *p = dst;
+  for (uint8_t i = 0; i < 4; ++i) {
+    uint8_t octet = ip[i];
+    if (octet >= 100) {
+      *p++ = '0' + octet / 100;
+      octet %= 100;
+      *p++ = '0' + octet / 10;
+    } else if (octet >= 10) {
+      *p++ = '0' + octet / 10;
+    }
+    *p++ = '0' + octet % 10;
+    *p++ = '.';
+  }
+  // Replace the last dot with a \0
+  *--p = '\0';
+  return p - dst;
+}
+
+uint8_t GSCore::formatNumber(char *dst, uint16_t value)
+{
+  // Generate digits in reverse, then copy them into place
+  char tmp[5];
+  uint8_t len = 0;
+  do {
+    tmp[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  for (uint8_t i = 0; i < len; ++i)
+    dst[i] = tmp[len - 1 - i];
+  dst[len] = '\0';
+  return len;
+}
+
+void GSCore::formatLength(char *dst, uint16_t value)
+{
+  for (int8_t i = 3; i >= 0; --i) {
+    dst[i] = '0' + value % 10;
+    value /= 10;
+  }
+}
+
+// Formats value in the given base (10 or 16) into the end of buf,
+// returning the start of the digits
+static char *format_unsigned(char *end, unsigned long value, uint8_t base, bool upper)
+{
+  char *p = end;
+  do {
+    uint8_t digit = value % base;
+    *--p = (digit < 10 ? '0' + digit : (upper ? 'A' : 'a') + digit - 10);
+    value /= base;
+  } while (value);
+  return p;
+}
+
+static size_t write_padding(Print &out, char c, size_t count)
+{
+  size_t written = 0;
+  while (count--)
+    written += out.write(c);
+  return written;
+}
+
+// Parses a width or precision, which is either a number or * to take
+// it from the arguments
+static int parse_width(const char **fmt, va_list *args)
+{
+  if (**fmt == '*') {
+    (*fmt)++;
+    return va_arg(*args, int);
+  }
+  int width = 0;
+  while (**fmt >= '0' && **fmt <= '9')
+    width = width * 10 + *(*fmt)++ - '0';
+  return width;
+}
+
+size_t GSCore::formatCommand(Print &out, const char *fmt, va_list args)
+{
+  // va_list might be an array type, so make a copy that can be passed
+  // by pointer
+  va_list ap;
+  va_copy(ap, args);
+
+  size_t written = 0;
+  while (*fmt) {
+    // Write everything up to the next conversion in one go
+    const char *next = strchr(fmt, '%');
+    size_t len = next ? next - fmt : strlen(fmt);
+    if (len)
+      written += out.write((const uint8_t*)fmt, len);
+    if (!next)
+      break;
+
+    fmt = next + 1;
+    bool left = false, zero = false;
+    while (*fmt == '-' || *fmt == '0') {
+      if (*fmt++ == '-')
+        left = true;
+      else
+        zero = true;
+    }
+    int width = parse_width(&fmt, &ap);
+    if (width < 0) {
+      left = true;
+      width = -width;
+    }
+    int precision = -1;
+    if (*fmt == '.') {
+      fmt++;
+      precision = parse_width(&fmt, &ap);
+    }
+    bool is_long = false;
+    if (*fmt == 'l') {
+      is_long = true;
+      fmt++;
+    }
+
+    // Room for a 32-bit number. The conversions below set p and end
+    // to the text to write, padded to the width.
+    char buf[10];
+    const char *end = buf + sizeof(buf);
+    const char *p;
+    bool negative = false;
+    switch (*fmt) {
+      case 'd':
+      case 'i':
+      {
+        long value = is_long ? va_arg(ap, long) : va_arg(ap, int);
+        unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+        p = format_unsigned(buf + sizeof(buf), magnitude, 10, false);
+        negative = (value < 0);
+        break;
+      }
+      case 'u':
+      case 'x':
+      case 'X':
+      {
+        unsigned long value = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+        p = format_unsigned(buf + sizeof(buf), value, *fmt == 'u' ? 10 : 16, *fmt == 'X');
+        break;
+      }
+      case 'c':
+        buf[0] = (char)va_arg(ap, int);
+        p = buf;
+        end = buf + 1;
+        break;
+      case 's':
+        p = va_arg(ap, const char*);
+        if (!p)
+          p = "";
+        end = p;
+        while (*end && (precision < 0 || end - p < precision))
+          end++;
+        break;
+      case 'q':
+      {
+        // Write the string in runs between characters that need
+        // escaping
+        const char *str = va_arg(ap, const char*);
+        while (str && *str) {
+          size_t run = strcspn(str, "\"\\");
+          if (run)
+            written += out.write((const uint8_t*)str, run);
+          str += run;
+          if (*str) {
+            written += out.write('\\');
+            written += out.write(*str++);
+          }
+        }
+        fmt++;
+        continue;
       }
+      case '%':
+        written += out.write('%');
+        fmt++;
+        continue;
+      default:
+        // Unsupported conversion. Its argument cannot be skipped
+        // without knowing its type, so stop rather than formatting
+        // the rest of the command using the wrong arguments.
+        va_end(ap);
+        return written;
     }
 
-    do {
-      c = processSpiSpecial(transferSpi(SPI_SPECIAL_IDLE));
-    } while (c == -1 && --tries > 0);
-  } else {
-    if (GS_LOG_ERRORS && this->error)
-      this->error->println("Begin() not called!");
-    return -1;
+    size_t text_len = (end - p) + negative;
+    size_t pad = ((size_t)width > text_len ? width - text_len : 0);
+    if (!left && !zero)
+      written += write_padding(out, ' ', pad);
+    if (negative)
+      written += out.write('-');
+    if (!left && zero)
+      written += write_padding(out, '0', pad);
+    written += out.write((const uint8_t*)p, end - p);
+    if (left)
+      written += write_padding(out, ' ', pad);
+    fmt++;
   }
-  return c;
+  va_end(ap);
+  return written;
 }
 
-/*******************************************************
- * Helper methods
- *******************************************************/
-
-bool GSCore::parseIpAddress(IPAddress *ip, const char *str, uint16_t len)
+void GSCore::parseSettingsLine(const uint8_t *buf, uint16_t len, uint8_t *profiles, setting_callback_t callback, void *data)
 {
-  *ip = (uint32_t)0;
-  int i = 0;
-  const char *end = (len ? str + len : NULL);
-  for (const char *p = str; *p && (end == NULL || p < end); ++p) {
-    if (*p == '.') {
-      ++i;
-      if (i >= 4)
-        return false;
-
-      (*ip)[i] = 0;
-      continue;
+  // Profile headers separate the current and stored profiles
+  for (uint16_t i = 0; i + 7 <= len; ++i) {
+    if (memcmp(buf + i, "PROFILE", 7) == 0) {
+      (*profiles)++;
+      return;
     }
+  }
+  if (*profiles > 1)
+    return;
 
-    if (*p < '0' || *p > '9')
-      return false;
-
-    if ((*ip)[i] >= 100 || ((*ip)[i] == 25 && *p > '5'))
-      return false;
+  uint16_t i = 0;
+  while (i < len) {
+    while (i < len && buf[i] == ' ')
+      ++i;
 
-    (*ip)[i] *= 10;
-    (*ip)[i] += (*p - '0');
+    uint16_t start = i;
+    bool quoted = false;
+    while (i < len && (quoted || buf[i] != ' ')) {
+      if (buf[i] == '"')
+        quoted = !quoted;
+      ++i;
+    }
+    if (i > start)
+      callback(buf + start, i - start, data);
   }
-  return true;
 }
 
 /*******************************************************
  * Internal helper methods
  *******************************************************/
 
-int GSCore::processSpiSpecial(uint8_t c)
+uint16_t GSCore::encodeSpi(const uint8_t *src, uint16_t len, uint8_t *dst)
+{
+  uint8_t *start = dst;
+  while (len--) {
+    uint8_t c = *src++;
+    if (pgm_read_byte(&spi_byte_class[c]) != SPI_CLASS_DATA) {
+      *dst++ = SPI_SPECIAL_ESC;
+      *dst++ = c ^ SPI_ESC_XOR;
+    } else {
+      *dst++ = c;
+    }
+  }
+  return dst - start;
+}
+
+uint16_t GSCore::decodeSpi(const uint8_t *src, uint16_t len, uint8_t *dst)
 {
   static uint8_t errorcount = 0;
-  int res = -1;
-  if (this->spi_prev_was_esc) {
-    // Previous byte was an escape byte, so unescape this byte but don't
-    // interpret any special characters inside.
-    this->spi_prev_was_esc = false;
-    res = c ^ SPI_ESC_XOR;
-  } else {
-    if (c != SPI_SPECIAL_ALL_ONE)
+  uint8_t *start = dst;
+  while (len--) {
+    uint8_t c = *src++;
+    if (this->spi_prev_was_esc) {
+      // Previous byte was an escape byte, so unescape this byte but
+      // don't interpret any special characters inside.
+      this->spi_prev_was_esc = false;
+      *dst++ = c ^ SPI_ESC_XOR;
+      continue;
+    }
+
+    uint8_t cls = pgm_read_byte(&spi_byte_class[c]);
+    if (cls != SPI_CLASS_ALL_ONE)
       errorcount = 0;
-    switch(c) {
-      case SPI_SPECIAL_ALL_ONE:
+
+    switch(cls) {
+      case SPI_CLASS_DATA:
+        *dst++ = c;
+        break;
+      case SPI_CLASS_ALL_ONE:
         // TODO: Handle these? Flag an error? Wait for SPI_SPECIAL_ACK?
-        if (GS_LOG_ERRORS && this->error)
+        if (GS_LOG_ERRORS && canLogError())
           this->error->println("SPI 0xff?");
         // Flag an unrecoverable error after 20 successive 0xff reads.
         // We've seen the gainspan module spewing 0xff (rather, dropping
@@ -839,54 +2310,37 @@ int GSCore::processSpiSpecial(uint8_t c)
           errorcount = 0;
         }
         break;
-      case SPI_SPECIAL_ALL_ZERO:
+      case SPI_CLASS_ALL_ZERO:
         // TODO: Handle these? Flag an error? Wait for SPI_SPECIAL_ACK?
         // Seems these happen when saving the current profile to flash
         // (probably because the APP firmware is too busy to refill the
         // SPI buffer in the module).
-        if (GS_LOG_ERRORS_VERBOSE && this->error)
+        if (GS_LOG_ERRORS_VERBOSE && canLogError())
           this->error->println("SPI 0x00?");
         break;
-      case SPI_SPECIAL_ACK:
+      case SPI_CLASS_ACK:
         // TODO: What does this one mean exactly?
-        if (GS_LOG_ERRORS && this->error)
+        if (GS_LOG_ERRORS && canLogError())
           this->error->println("SPI ACK received?");
         break;
-      case SPI_SPECIAL_IDLE:
+      case SPI_CLASS_IDLE:
         break;
-      case SPI_SPECIAL_XOFF:
+      case SPI_CLASS_XOFF:
         this->spi_xoff = true;
         break;
-      case SPI_SPECIAL_XON:
+      case SPI_CLASS_XON:
         this->spi_xoff = false;
         break;
-      case SPI_SPECIAL_ESC:
+      case SPI_CLASS_ESC:
         this->spi_prev_was_esc = true;
         break;
-      default:
-        res = c;
-        break;
     }
   }
-  if (GS_DUMP_BYTES && this->debug)
-    dump_byte(this->debug, "<= ", res);
-  return res;
-}
-
-bool GSCore::isSpiSpecial(uint8_t c)
-{
-  switch(c) {
-    case SPI_SPECIAL_ALL_ONE:
-    case SPI_SPECIAL_ALL_ZERO:
-    case SPI_SPECIAL_ACK:
-    case SPI_SPECIAL_IDLE:
-    case SPI_SPECIAL_XOFF:
-    case SPI_SPECIAL_XON:
-    case SPI_SPECIAL_ESC:
-      return true;
-    default:
-      return false;
+  if (GS_DUMP_BYTES && this->debug && !this->in_interrupt) {
+    for (uint8_t *p = start; p < dst; ++p)
+      dump_byte(this->debug, "<= ", *p);
   }
+  return dst - start;
 }
 
 bool GSCore::processIncoming(int c)
@@ -899,6 +2353,9 @@ bool GSCore::processIncoming(int c)
       if (c == 0x1b) {
         // Escape character, incoming data
         this->rx_state = GS_RX_ESC;
+      } else if (this->rx_response) {
+        // Part of the response to a command
+        processResponseByte(this->rx_response, c);
       } else {
         // Don't log \r\n, since the synchronous response parsing
         // often leaves a \n behind. Only log in VERBOSE, since some
@@ -911,9 +2368,37 @@ bool GSCore::processIncoming(int c)
       break;
 
     case GS_RX_ESC:
-      // Note: <Esc>O and <Esc>F are handled in readDataResponse, since
-      // they should never be received asynchronously
+      // Note: <Esc>O and <Esc>F are handled in readDataResponse, except
+      // for frames sent in pipelined mode
       switch (c) {
+        case 'O':
+        case 'F':
+        {
+          this->rx_state = GS_RX_IDLE;
+          if (this->tx_frames_acked == this->tx_frames_tail) {
+            if (GS_LOG_ERRORS && this->error) {
+              this->error->print("Unexpected data response: <Esc>");
+              this->error->write(c);
+              this->error->println();
+            }
+            break;
+          }
+
+          TxFrame &frame = this->tx_frames[this->tx_frames_acked++ & (TX_PIPELINE_SIZE - 1)];
+          if (c == 'O') {
+            frame.state = GS_TX_FRAME_OK;
+          } else {
+            frame.state = GS_TX_FRAME_FAILED;
+            this->tx_frames_failed++;
+            this->connections[frame.cid].error = true;
+            if (GS_LOG_ERRORS && this->error) {
+              this->error->print("Sending bulk data frame failed for cid ");
+              this->error->println(frame.cid);
+            }
+          }
+          break;
+        }
+
         case 'Z':
           // Incoming TCP client/server or UDP client data
           // <Esc>Z<CID><Data Length xxxx 4 ascii char><data>
@@ -1117,110 +2602,511 @@ bool GSCore::processIncoming(int c)
       break;
 
     case GS_RX_BULK:
-      bufferIncomingData(c);
+    {
+      uint8_t b = c;
+      bufferIncomingData(&b, 1);
       if(--this->head_frame.length == 0)
         this->rx_state = GS_RX_IDLE;
       break;
+    }
+  }
+  return true;
+}
+
+void GSCore::processIncoming(const uint8_t *buf, size_t len)
+{
+  while (len) {
+    if (this->rx_state == GS_RX_BULK) {
+      // Inside a data frame, the bytes need no further parsing, so
+      // buffer as much of the frame as we have in one go
+      uint16_t n = this->head_frame.length;
+      if (n > len)
+        n = len;
+      bufferIncomingData(buf, n);
+      buf += n;
+      len -= n;
+      this->head_frame.length -= n;
+      if (this->head_frame.length == 0)
+        this->rx_state = GS_RX_IDLE;
+    } else {
+      processIncoming(*buf++);
+      len--;
+    }
+  }
+}
+
+void GSCore::dispatchData()
+{
+  for (cid_t cid = 0; cid <= this->max_cid; ++cid) {
+    RXQueue &q = this->rx_queues[cid];
+    // The callback might clear itself, so check it every round
+    for (uint8_t i = 0; i < MAX_DISPATCH_ROUNDS && q.on_data; ++i) {
+      if (q.first == RX_NO_BLOCK) {
+        // Nothing buffered, but when the module is sending a frame for
+        // this cid, read it
+        if (this->rx_state != GS_RX_BULK || this->head_frame.cid != cid || !pumpIncoming())
+          break;
+        continue;
+      }
+
+      // Since the queue is not empty, this never reads from the module
+      RXFrame frame = getFrameHeader(cid);
+      if (!frame.length)
+        break;
+
+      if (q.on_data_payload) {
+        // If only the header was buffered, this reads some data
+        DataSpan spans[2];
+        if (!peekData(cid, spans))
+          continue;
+        q.on_data(this->eventData, cid, frame, spans[0].data, spans[0].len);
+        consumeData(cid, spans[0].len);
+      } else {
+        q.on_data(this->eventData, cid, frame, NULL, 0);
+        // When the callback did not read anything, try again on the
+        // next loop()
+        if (q.left == frame.length)
+          break;
+      }
+    }
+  }
+}
+
+bool GSCore::pumpIncoming()
+{
+  int c = readRaw();
+  if (c < 0)
+    return false;
+
+  // With backpressure, readRaw() must be able to stop reading as soon
+  // as the queue fills up, so don't read ahead
+  if (this->rx_overflow_policy == GS_RX_BACKPRESSURE) {
+    processIncoming(c);
+    return true;
+  }
+
+  if (this->ss_pin != INVALID_PIN) {
+    processIncoming(c);
+    // Process whatever is already in spi_rx_buf (without polling the
+    // module again), copying payload runs straight into the receive
+    // queue. Limit this to one buffer full, since the rx interrupt
+    // might keep adding bytes.
+    uint8_t budget = this->spi_rx_buf_size;
+    while (budget && this->spi_rx_head != this->spi_rx_tail) {
+      if (this->rx_state == GS_RX_BULK) {
+        budget -= pumpSpiPayload(budget);
+      } else {
+        processIncoming(readRaw());
+        budget--;
+      }
+    }
+    return true;
+  }
+
+  // Collect whatever is already available in the serial buffer and
+  // process it as a single block. Stream only offers reading byte by
+  // byte, so this cannot copy into the receive queue directly.
+  uint8_t buf[2 * SPI_BLOCK_SIZE];
+  uint8_t len = 0;
+  buf[len++] = c;
+  while (len < sizeof(buf) && this->serial->available()) {
+    c = readRaw();
+    if (c < 0)
+      break;
+    buf[len++] = c;
   }
+  processIncoming(buf, len);
   return true;
 }
 
-void GSCore::bufferIncomingData(uint8_t c)
+uint8_t GSCore::pumpSpiPayload(uint8_t max)
+{
+  // Only the rx interrupt changes spi_rx_head, and it only adds bytes,
+  // so everything up to head can be read safely.
+  uint8_t tail = this->spi_rx_tail;
+  uint8_t head = this->spi_rx_head;
+  uint8_t n = (head > tail ? head : this->spi_rx_buf_size) - tail;
+  if (n > max)
+    n = max;
+  if (n > this->head_frame.length)
+    n = this->head_frame.length;
+
+  bufferIncomingData(&this->spi_rx_buf[tail], n);
+  this->spi_rx_tail = (tail + n) & (this->spi_rx_buf_size - 1);
+  this->head_frame.length -= n;
+  if (this->head_frame.length == 0)
+    this->rx_state = GS_RX_IDLE;
+  return n;
+}
+
+void GSCore::bufferIncomingData(const uint8_t *buf, uint16_t len)
 {
-  rx_data_index_t next_head = (this->rx_data_head + 1) % sizeof(this->rx_data);
-  if (next_head == this->rx_data_tail)
-    dropData(1);
+  cid_t cid = this->head_frame.cid;
+  while (len) {
+    if (this->rx_discard || !makeRoom(cid, 1) || this->rx_discard)
+      break;
+
+    // Fill up whatever room there is, then make room for the rest
+    // (possibly dropping older frames), just like when buffering
+    // byte by byte.
+    uint16_t n = queueRoom(cid);
+    if (n > len)
+      n = len;
+    enqueueData(cid, buf, n);
+    buf += n;
+    len -= n;
+  }
 
-  this->rx_data[this->rx_data_head] = c;
-  this->rx_data_head = next_head;
+  // Data for cids we have no room for is ignored
+  if (len && cid <= this->max_cid) {
+    // If makeRoom dropped the frame being received (or failed to make
+    // room), the other bytes have been counted already
+    if (!this->rx_discard)
+      dropIncomingFrame(cid);
+    this->rx_queues[cid].dropped_bytes += len;
+  }
 }
 
 void GSCore::bufferFrameHeader(const RXFrame *frame)
 {
-  if (this->rx_data_head == this->rx_data_tail) {
-    // Ringbuffer is empty, so this frame becomes the tail_frame
-    // directly.
-    this->tail_frame = this->head_frame;
-  } else {
-    // There is a previous frame in the ringbuffer, so put in the
-    // frame info in the ringbuffer as well.
-    if ( this->rx_data_head > sizeof(this->rx_data) - sizeof(*frame)) {
-      // The RXFrame structure doesn't fit in the ringbuffer
-      // consecutively. Skip a few bytes to skip back to the start.
-      // But if we don't have room to do that, we'll have to drop bytes
-      // from the tail to make room.
-      if (this->rx_data_tail > this->rx_data_head)
-        dropData(this->rx_data_tail - this->rx_data_tail);
-      if (this->rx_data_tail == 0)
-        dropData(1);
-
-      this->rx_data_head = 0;
+  this->rx_discard = false;
+
+  if (frame->cid > this->max_cid) {
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Ignoring frame for cid ");
+      this->error->println(frame->cid);
     }
+    this->rx_discard = true;
+    return;
+  }
+
+  RXQueue &q = this->rx_queues[frame->cid];
+  if (this->rx_overflow_policy == GS_RX_DROP_NEWEST &&
+      (q.first != RX_NO_BLOCK || q.left) &&
+      queueRoom(frame->cid) < RX_UDP_HEADER_SIZE + frame->length) {
+    dropIncomingFrame(frame->cid);
+    return;
+  }
 
-    // Make sure there's enough space
-    uint8_t free = (this->rx_data_tail - this->rx_data_head - 1) % sizeof(this->rx_data);
-    if (free < sizeof(*frame))
-      dropData(sizeof(*frame) - free);
+  // The header is stored compactly: The cid is implied by the queue,
+  // the length is stored little endian, with the top bit set for UDP
+  // server frames. Those are followed by the remote IP address and
+  // (little endian) port.
+  uint8_t header[RX_UDP_HEADER_SIZE];
+  uint8_t len = RX_HEADER_SIZE;
+  uint16_t length = frame->length;
+  if (frame->udp_server) {
+    uint32_t ip = frame->ip;
+    memcpy(&header[2], &ip, sizeof(ip));
+    header[6] = frame->port;
+    header[7] = frame->port >> 8;
+    length |= RX_HEADER_UDP_FLAG;
+    len = RX_UDP_HEADER_SIZE;
+  }
+  header[0] = length;
+  header[1] = length >> 8;
 
-    // Copy the frame header
-    memcpy(&this->rx_data[this->rx_data_head], frame, sizeof(*frame));
-    this->rx_data_head += sizeof(*frame);
+  // Make room for the entire header first, so we never drop a partial
+  // header
+  if (!makeRoom(frame->cid, len)) {
+    dropIncomingFrame(frame->cid);
+    return;
   }
+  enqueueData(frame->cid, header, len);
 }
 
-void GSCore::loadFrameHeader(RXFrame* frame)
+void GSCore::loadFrameHeader(cid_t cid, RXFrame* frame)
 {
-  if (sizeof(this->rx_data) - this->rx_data_tail < sizeof(*frame)) {
-    // The RXFrame structure didn't fit in the ringbuffer
-    // consecutively. Skip a few bytes to skip back to the start
-    this->rx_data_tail = 0;
+  // See bufferFrameHeader for the format
+  uint8_t header[RX_UDP_HEADER_SIZE];
+  dequeueData(cid, header, RX_HEADER_SIZE);
+  uint16_t length = header[0] | header[1] << 8;
+
+  frame->cid = cid;
+  frame->udp_server = (length & RX_HEADER_UDP_FLAG);
+  frame->length = length & ~RX_HEADER_UDP_FLAG;
+  if (frame->udp_server) {
+    dequeueData(cid, &header[2], RX_UDP_HEADER_SIZE - RX_HEADER_SIZE);
+    uint32_t ip;
+    memcpy(&ip, &header[2], sizeof(ip));
+    frame->ip = ip;
+    frame->port = header[6] | header[7] << 8;
+  } else {
+    frame->ip = (uint32_t)0;
+    frame->port = 0;
   }
-  memcpy(frame, &this->rx_data[this->rx_data_tail], sizeof(*frame));
-  this->rx_data_tail += sizeof(*frame);
+
+  // Keep the details, getFrameHeader() needs them until the frame was
+  // read completely
+  RXQueue &q = this->rx_queues[cid];
+  q.left = frame->length;
+  q.udp_server = frame->udp_server;
+  q.ip = frame->ip;
+  q.port = frame->port;
 }
 
-GSCore::RXFrame GSCore::getFrameHeader(cid_t cid)
+bool GSCore::startFrame(cid_t cid)
 {
-  if (this->tail_frame.length == 0) {
-    if (this->rx_data_tail != this->rx_data_head) {
-      // The current frame is empty, but there is still data in rx_data.
-      // Load the next frame.
-     loadFrameHeader(&this->tail_frame);
+  RXQueue &q = this->rx_queues[cid];
+  while (q.left == 0) {
+    if (q.first != RX_NO_BLOCK) {
+      // The current frame is empty, but there is still data in the
+      // queue. Load the next frame.
+      RXFrame frame;
+      loadFrameHeader(cid, &frame);
     } else {
-      // The buffer is empty. See if we can read more data from the
-      // module.
-      while (this->tail_frame.length == 0) {
-        // Don't block
-        if (!processIncoming(readRaw()))
-          return RXFrame();
-      }
+      // The queue is empty. See if we can read more data from the
+      // module. This might buffer data for other cids as well.
+      // Don't block
+      if (!pumpIncoming())
+        return false;
     }
   }
+  return true;
+}
 
-  if (cid == ANY_CID || this->tail_frame.cid == cid)
-    return this->tail_frame;
-  else
+GSCore::cid_t GSCore::nextCidWithData()
+{
+  // Once we started returning a frame, finish it first
+  if (this->rx_any_cid != INVALID_CID && this->rx_queues[this->rx_any_cid].left)
+    return this->rx_any_cid;
+
+  do {
+    cid_t start = 0;
+    if (this->rx_policy == GS_RX_ROUND_ROBIN && this->rx_any_cid != INVALID_CID)
+      start = this->rx_any_cid + 1;
+
+    for (uint8_t i = 0; i <= this->max_cid; ++i) {
+      cid_t cid = start + i;
+      if (cid > this->max_cid)
+        cid -= this->max_cid + 1;
+      RXQueue &q = this->rx_queues[cid];
+      // Since the queue is not empty, this never reads from the module
+      if ((q.left || q.first != RX_NO_BLOCK) && startFrame(cid)) {
+        this->rx_any_cid = cid;
+        return cid;
+      }
+    }
+    // Nothing buffered. See if we can read more data from the module,
+    // but don't block
+  } while (pumpIncoming());
+
+  return INVALID_CID;
+}
+
+GSCore::RXFrame GSCore::getFrameHeader(cid_t cid)
+{
+  if (cid == ANY_CID) {
+    cid = nextCidWithData();
+    if (cid == INVALID_CID)
+      return RXFrame();
+  } else if (cid > this->max_cid || !startFrame(cid)) {
     return RXFrame();
+  }
+
+  RXQueue &q = this->rx_queues[cid];
+  RXFrame frame;
+  frame.cid = cid;
+  frame.length = q.left;
+  frame.udp_server = q.udp_server;
+  frame.ip = q.ip;
+  frame.port = q.port;
+  return frame;
 }
 
-int GSCore::getData()
+uint16_t GSCore::readFrameData(cid_t cid, uint8_t *buf, uint16_t len)
 {
-  if (this->rx_data_tail != this->rx_data_head) {
-    // There is data in the buffer, read it
-    int c = this->rx_data[this->rx_data_tail];
-    this->rx_data_tail = (this->rx_data_tail + 1) % sizeof(this->rx_data);
-    this->tail_frame.length--;
-    return c;
-  } else {
-    // No data buffered, try reading from the module directly
-    int c = readRaw();
-    if (c >= 0) {
-      this->tail_frame.length--;
-      if(--this->head_frame.length == 0)
+  RXQueue &q = this->rx_queues[cid];
+  if (len > q.left)
+    len = q.left;
+
+  uint16_t read;
+  if (q.first != RX_NO_BLOCK) {
+    // There is data in the queue, read it. Since len is limited to the
+    // current frame, this never reads into the next frame header.
+    read = dequeueData(cid, buf, len);
+  } else if (this->rx_state == GS_RX_BULK && this->head_frame.cid == cid) {
+    // No data buffered, but the module is sending data for this frame.
+    // Read from the module directly, as long as it keeps sending us
+    // data.
+    read = 0;
+    while (read < len) {
+      int c = readRaw();
+      if (c == -1)
+        break;
+      buf[read++] = c;
+      if(--this->head_frame.length == 0) {
         this->rx_state = GS_RX_IDLE;
+        break;
+      }
+    }
+  } else {
+    // No data buffered and the module is not in the middle of our
+    // frame (e.g. still sending the frame header). Process whatever
+    // is available and let the caller retry.
+    pumpIncoming();
+    read = 0;
+  }
+  q.left -= read;
+  return read;
+}
+
+uint16_t GSCore::queuedData(cid_t cid)
+{
+  RXQueue &q = this->rx_queues[cid];
+  if (q.first == RX_NO_BLOCK)
+    return 0;
+  if (q.first == q.last)
+    return q.write - q.read;
+  return (RX_BLOCK_SIZE - q.read) + (q.blocks - 2) * RX_BLOCK_SIZE + q.write;
+}
+
+uint16_t GSCore::queueRoom(cid_t cid)
+{
+  RXQueue &q = this->rx_queues[cid];
+  uint8_t blocks = q.budget - q.blocks;
+  if (blocks > this->rx_free_count)
+    blocks = this->rx_free_count;
+
+  uint16_t room = blocks * RX_BLOCK_SIZE;
+  if (q.first != RX_NO_BLOCK)
+    room += RX_BLOCK_SIZE - q.write;
+  return room;
+}
+
+bool GSCore::makeRoom(cid_t cid, uint8_t len)
+{
+  while (queueRoom(cid) < len) {
+    // The frame being received was dropped, so there is no need to
+    // make room for it anymore
+    if (this->rx_discard)
+      return false;
+
+    cid_t victim = cid;
+    RXQueue &q = this->rx_queues[cid];
+    if (this->rx_overflow_policy != GS_RX_DROP_NEWEST && q.blocks < q.budget) {
+      // This cid is within its budget, so the buffer must be full.
+      // Take space from whichever cid uses the most.
+      for (cid_t i = 0; i <= this->max_cid; ++i) {
+        if (this->rx_queues[i].blocks > this->rx_queues[victim].blocks)
+          victim = i;
+      }
     }
-    return c;
+    if (!dropFrame(victim))
+      return false;
+  }
+  return true;
+}
+
+bool GSCore::rxBlocked()
+{
+  if (this->rx_overflow_policy != GS_RX_BACKPRESSURE)
+    return false;
+
+  // Someone is waiting for a reply, which might be behind data that
+  // does not fit. Keep reading, so makeRoom() drops data instead.
+  if (this->rx_response || this->rx_waiting || this->tx_frames_tail != this->tx_frames_acked)
+    return false;
+
+  cid_t cid;
+  switch (this->rx_state) {
+    case GS_RX_BULK:
+      cid = this->head_frame.cid;
+      return !this->rx_discard && cid <= this->max_cid && queueRoom(cid) == 0;
+    case GS_RX_ESC_Z:
+    case GS_RX_ESC_y_1:
+    case GS_RX_ESC_y_2:
+    case GS_RX_ESC_y_3:
+      // Once the cid of a frame is known, stop reading its header when
+      // there is no room to store it (and at least one byte of data),
+      // since storing it would mean dropping older data.
+      if (this->rx_async_len == 0 || !parseNumber(&cid, this->rx_async, 1, 16))
+        return false;
+      return cid <= this->max_cid && queueRoom(cid) <= RX_UDP_HEADER_SIZE;
+    default:
+      // Replies and async events are not buffered
+      return false;
+  }
+}
+
+void GSCore::enqueueData(cid_t cid, const uint8_t *buf, uint16_t len)
+{
+  RXQueue &q = this->rx_queues[cid];
+  while (len) {
+    if (q.first == RX_NO_BLOCK || q.write == RX_BLOCK_SIZE) {
+      if (!allocRxBlock(cid))
+        return;
+    }
+
+    uint8_t n = RX_BLOCK_SIZE - q.write;
+    if (n > len)
+      n = len;
+    memcpy(&this->rx_data[q.last * RX_BLOCK_SIZE + q.write], buf, n);
+    q.write += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+uint16_t GSCore::dequeueData(cid_t cid, uint8_t *buf, uint16_t len)
+{
+  RXQueue &q = this->rx_queues[cid];
+  uint16_t done = 0;
+  while (done < len && q.first != RX_NO_BLOCK) {
+    // Read up to the end of the block, or up to the write offset for
+    // the last block
+    uint8_t end = (q.first == q.last ? q.write : RX_BLOCK_SIZE);
+    uint8_t n = end - q.read;
+    if (n > len - done)
+      n = len - done;
+    if (buf)
+      memcpy(buf + done, &this->rx_data[q.first * RX_BLOCK_SIZE + q.read], n);
+    q.read += n;
+    done += n;
+
+    if (q.read == end)
+      freeRxBlock(cid);
+  }
+  return done;
+}
+
+bool GSCore::allocRxBlock(cid_t cid)
+{
+  RXQueue &q = this->rx_queues[cid];
+  if (this->rx_free_block == RX_NO_BLOCK || q.blocks >= q.budget)
+    return false;
+
+  uint8_t block = this->rx_free_block;
+  this->rx_free_block = this->rx_block_next[block];
+  this->rx_free_count--;
+  this->rx_block_next[block] = RX_NO_BLOCK;
+
+  if (q.first == RX_NO_BLOCK) {
+    q.first = block;
+    q.read = 0;
+  } else {
+    this->rx_block_next[q.last] = block;
   }
+  q.last = block;
+  q.write = 0;
+  q.blocks++;
+  return true;
+}
+
+void GSCore::freeRxBlock(cid_t cid)
+{
+  RXQueue &q = this->rx_queues[cid];
+  uint8_t block = q.first;
+  if (block == q.last)
+    q.first = q.last = RX_NO_BLOCK;
+  else
+    q.first = this->rx_block_next[block];
+  q.read = 0;
+  q.blocks--;
+
+  this->rx_block_next[block] = this->rx_free_block;
+  this->rx_free_block = block;
+  this->rx_free_count++;
 }
 
 void GSCore::readAndProcessAsync()
@@ -1245,17 +3131,45 @@ void GSCore::readAndProcessAsync()
   }
 }
 
-void GSCore::dropData(uint8_t num_bytes) {
-  while(num_bytes--) {
-    cid_t cid;
-    if (readData(&cid) >= 0) {
-      if (GS_LOG_ERRORS && this->error) {
-        this->error->print("rx_data is full, dropped byte for cid ");
-        this->error->println(cid);
-      }
-      this->connections[cid].error = true;
-    }
+bool GSCore::dropFrame(cid_t cid)
+{
+  RXQueue &q = this->rx_queues[cid];
+  if (q.left == 0) {
+    // Not currently reading a frame, so drop the next one
+    if (q.first == RX_NO_BLOCK)
+      return false;
+    RXFrame frame;
+    loadFrameHeader(cid, &frame);
+  }
+
+  uint16_t len = dequeueData(cid, NULL, q.left);
+  if (len < q.left && this->rx_state == GS_RX_BULK && this->head_frame.cid == cid) {
+    // The frame is still being received, drop the rest when it
+    // arrives
+    this->rx_discard = true;
+  }
+  q.left = 0;
+  q.dropped_frames++;
+  q.dropped_bytes += len;
+
+  if (GS_LOG_ERRORS && this->error) {
+    this->error->print("rx_data is full, dropped frame for cid ");
+    this->error->println(cid);
+  }
+  this->connections[cid].error = true;
+  return true;
+}
+
+void GSCore::dropIncomingFrame(cid_t cid)
+{
+  this->rx_discard = true;
+  this->rx_queues[cid].dropped_frames++;
+
+  if (GS_LOG_ERRORS && this->error) {
+    this->error->print("rx_data is full, dropped incoming frame for cid ");
+    this->error->println(cid);
   }
+  this->connections[cid].error = true;
 }
 
 GSCore::GSResponse GSCore::processResponseLine(const uint8_t* buf, uint8_t len, cid_t *connect_cid)
@@ -1473,7 +3387,8 @@ bool GSCore::processAsync()
           this->error->print("Socket error on cid ");
           this->error->println(cid);
         }
-        this->connections[cid].error = true;
+        if (cid <= this->max_cid)
+          this->connections[cid].error = true;
       }
       processDisconnect(cid);
       return true;
@@ -1571,7 +3486,7 @@ void GSCore::processDisassociation()
     this->events |= EVENT_DISASSOCIATED;
 
   this->associated = false;
-  for (cid_t cid = 0; cid <= MAX_CID; ++cid) {
+  for (cid_t cid = 0; cid <= this->max_cid; ++cid) {
     if (this->connections[cid].connected) {
       this->connections[cid].error = true;
       processDisconnect(cid);
@@ -1581,6 +3496,14 @@ void GSCore::processDisassociation()
 
 void GSCore::processConnect(cid_t cid, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, bool ncm)
 {
+  if (cid > this->max_cid) {
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("No room to keep track of cid ");
+      this->error->println(cid);
+    }
+    return;
+  }
+
   // Did we think this cid is still connected? We must have missed a
   // disconnect somewhere.
   if (this->connections[cid].connected)
@@ -1602,7 +3525,7 @@ void GSCore::processConnect(cid_t cid, uint32_t remote_ip, uint16_t remote_port,
 
 void GSCore::processDisconnect(cid_t cid)
 {
-  if (!this->connections[cid].connected)
+  if (cid > this->max_cid || !this->connections[cid].connected)
     return;
 
   this->connections[cid].connected = false;
@@ -31,6 +31,8 @@
 #include <Stream.h>
 #include <IPAddress.h>
 #include <SPI.h>
+#include "util.h"
+#include "static_assert.h"
 
 #if !defined(SPI_HAS_TRANSACTION) || !SPI_HAS_TRANSACTION
 #error "This library requires Arduino IDE 1.5.8 or above, supporting the SPI transaction API"
@@ -65,6 +67,9 @@ const bool GS_DUMP_SPI = false;
  * This class contains the core code for communicating with the module.
  * You'll likely want to use GSModule instead, which adds some higher
  * level method for sending commands
+ *
+ * This class does not contain any buffers itself, use GSCoreT (or
+ * GSModuleT) to get an instance with buffers of a given size.
  */
 class GSCore {
 public:
@@ -82,16 +87,74 @@ public:
   /** Biggest valid CID */
   static const uint8_t MAX_CID = 0xf;
 
+  /**
+   * Default size of the buffer for received connection data. Since a
+   * single bulk frame can be up to 1400 bytes, a frame might not fit
+   * into this buffer entirely. On boards with more RAM, a bigger buffer
+   * can be used by using GSModuleT or GSCoreT instead.
+   */
+  static const uint16_t RX_DATA_BUF_SIZE = 512;
+
+  /**
+   * The received data buffer is divided into blocks of this size.
+   * Buffer sizes should be a multiple of this.
+   */
+  static const uint8_t RX_BLOCK_SIZE = 32;
+
+  /** Default size of the buffer for received SPI bytes */
+  static const uint8_t SPI_RX_BUF_SIZE = 64;
+
+  /** Default size of the SPI transmit queue */
+  static const uint8_t TX_QUEUE_SIZE = 64;
+
+  /**
+   * How long (in ms) to stop using burst SPI transfers after the module
+   * ignored bytes within a burst, see setSpiBurst()
+   */
+  static const uint16_t SPI_BURST_RETRY_INTERVAL = 10000;
+
+  /** The maximum size of a single data frame sent or received */
+  static const uint16_t MAX_FRAME_SIZE = 1400;
+
+  /** The maximum number of data frames in flight, see setTxPipeline() */
+  static const uint8_t TX_PIPELINE_SIZE = 8;
+
+  /** The maximum number of writes queued by writeDataAsync() */
+  static const uint8_t ASYNC_WRITE_QUEUE_SIZE = 4;
+
+  /** The maximum number of commands queued by writeCommandAsync() */
+  static const uint8_t COMMAND_QUEUE_SIZE = 4;
+
+  /**
+   * Size of the buffer holding the text of commands queued by
+   * writeCommandAsync() (excluding the trailing \r\n).
+   */
+  static const uint8_t COMMAND_TEXT_SIZE = 128;
+
   /** Value to indicate "no pin" */
   static const uint8_t INVALID_PIN = 0xff;
 
   /**
-   * How many milliseconds to wait for a a response? Should be fairly
-   * big, since the AT+WA command might take quite a bit of time
-   * TODO: Allow different timeouts per command?
+   * How many milliseconds to wait for the startup banner and for data
+   * responses (<Esc>O / <Esc>F). Command responses use the timeouts
+   * set through setTimeout() instead.
    */
   static const unsigned long RESPONSE_TIMEOUT = 20 * 1000;
 
+  /**
+   * After a command timed out, a marker command is sent to find out
+   * which response belongs to which command again, see resync(). The
+   * module is considered synchronized when no response arrived for
+   * this many milliseconds after the response to the marker.
+   */
+  static const unsigned long RESYNC_QUIET_TIME = 100;
+
+  /**
+   * The number of times the marker command can go unanswered before
+   * the module is considered unresponsive.
+   */
+  static const uint8_t MAX_RESYNC_ATTEMPTS = 2;
+
   /**
    * A buffer of this size should fit every line of data in a response.
    * Since it's data, it's hard to predict how much is needed, but it's
@@ -116,6 +179,12 @@ public:
    *  explicit disassiation). */
   void (*onDisassociate)(void *data) = NULL;
 
+  /** Called when the module acknowledged a data frame sent in
+   *  pipelined mode (see setTxPipeline()). ok is false when the module
+   *  refused the frame. Frames are reported in the order they were
+   *  sent. */
+  void (*onTxFrame)(void *data, cid_t cid, bool ok) = NULL;
+
   /** Data passed to all event handlers */
   void *eventData = NULL;
 
@@ -129,11 +198,12 @@ public:
  * Methods for setting up the module
  *******************************************************/
 
-  GSCore();
-
   /**
    * Set up this library to talk over a UART specified by the given
    * stream.
+   *
+   * Fails when the rx overflow policy is GS_RX_BACKPRESSURE, which
+   * only works in SPI mode.
    */
   bool begin(Stream &serial);
 
@@ -168,6 +238,93 @@ public:
    */
   void end();
 
+  /**
+   * Enable or disable fast start, before calling begin().
+   *
+   * Normally, begin() waits for the startup banner the module prints
+   * after a reset. However, when only the Arduino was reset, the
+   * module is still running and already set up, so no banner is
+   * printed and begin() times out.
+   *
+   * With fast start, begin() first queries the module settings. When
+   * the module replies, setup commands are only sent for settings that
+   * are not set already and there is no need to wait for a banner. The
+   * association state and open connections are then read back from the
+   * module, so isAssociated() and getConnectionInfo() stay accurate.
+   * When the module does not reply (for example because it is still
+   * starting up), begin() continues normally.
+   *
+   * See getStartupStats() for the time spent.
+   */
+  void setFastStart(bool enable) { this->fast_start = enable; }
+
+  struct StartupStats {
+    /** Milliseconds spent querying the module for fast start */
+    uint32_t probe_time;
+    /** Milliseconds spent waiting for the startup banner */
+    uint32_t banner_time;
+    /** Milliseconds spent sending setup commands */
+    uint32_t setup_time;
+    /** Total milliseconds spent in begin() */
+    uint32_t total_time;
+    /** The number of setup commands sent */
+    uint8_t commands;
+    /** True when fast start found the module running already */
+    bool warm;
+  };
+
+  /**
+   * Return statistics about the last call to begin().
+   */
+  const StartupStats& getStartupStats() { return this->startup_stats; }
+
+  /**
+   * Callback for negotiateBaudRate(), which should reconfigure the
+   * UART on the Arduino side to the given baud rate (after waiting for
+   * any pending output to be sent). It is first called with check_only
+   * set, before the module is switched, and should then only check
+   * whether the baud rate is supported. For example:
+   *
+   *   static bool set_baud(void *data, uint32_t baud, bool check_only) {
+   *     if (check_only)
+   *       return baud <= 460800;
+   *     Serial1.flush();
+   *     Serial1.begin(baud);
+   *     return true;
+   *   }
+   *
+   * @returns false when the baud rate is not supported.
+   */
+  typedef bool (*baud_callback_t)(void *data, uint32_t baud, bool check_only);
+
+  /**
+   * Change the baud rate used by the module's UART (using ATB) and
+   * the Arduino side (using the callback) to speed up transfers. Only
+   * works in UART mode, after begin().
+   *
+   * The callback is asked first whether the Arduino side supports the
+   * new rate, so the module is never switched to a rate the Arduino
+   * cannot follow. After switching, the link is verified with a probe
+   * command. When that fails, both sides are switched back to the
+   * current baud rate.
+   * If the module cannot be reached at either rate, an unrecoverable
+   * error is flagged.
+   *
+   * The new baud rate is not saved in the module profile, so after a
+   * reset, the module uses its default rate again.
+   *
+   * @param baud      The baud rate to use. The GS1011 supports up to
+   *                  921600 baud.
+   * @param current   The baud rate currently in use.
+   * @param callback  Called to change the baud rate of the Arduino
+   *                  side.
+   * @param data      Passed to the callback.
+   *
+   * @returns true when the link now runs at the new baud rate, false
+   * when it still runs at the current baud rate (or not at all).
+   */
+  bool negotiateBaudRate(uint32_t baud, uint32_t current, baud_callback_t callback, void *data);
+
   /**
    * This method should be called regularly to process any pending data.
    * All callbacks will be called from within this method as well.
@@ -188,6 +345,95 @@ public:
    */
   void setLogOutput(Print *error, Print *debug) { this->error = error; this->debug = debug; }
 
+  /**
+   * Enable or disable burst SPI transfers. In burst mode, the slave
+   * select pin is kept low for a block of bytes, instead of toggling it
+   * for every byte. This significantly increases throughput, but not
+   * every module firmware supports it.
+   *
+   * Burst mode is enabled by default. When the module is detected to
+   * ignore bytes within a burst, the ignored bytes are transferred
+   * again and burst mode is not used for SPI_BURST_RETRY_INTERVAL
+   * milliseconds.
+   */
+  void setSpiBurst(bool enable) { this->spi_burst = enable; }
+
+  /**
+   * Enable or disable reading data from an interrupt.
+   *
+   * When enabled, a rising edge on the data_ready pin triggers an
+   * interrupt that reads data from the module into a buffer, without
+   * waiting for loop() or one of the read methods to be called. This
+   * data is then processed on the next call to loop() or any of the
+   * read methods.
+   *
+   * This can only be enabled in SPI mode, when a data_ready pin was
+   * passed to begin() that supports interrupts (see
+   * digitalPinToInterrupt()). Only one GSCore instance can use this at
+   * the same time.
+   *
+   * Note that any other code that uses the SPI bus from within an
+   * interrupt handler must also use SPI transactions and call
+   * SPI.usingInterrupt().
+   *
+   * @returns true when the interrupt was enabled or disabled, false
+   *          when it is not supported.
+   */
+  bool setRxInterrupt(bool enable);
+
+  /**
+   * When no data_ready pin is available, we need to poll. Make sure
+   * that when readRaw() will stall for the full 64-byte poll at most
+   * once during the poll interval (and if readRaw() is called often, it
+   * should never stall at all).
+   *
+   * The poll interval adapts to the amount of data received: it is
+   * halved whenever data is received and doubled whenever a full poll
+   * finds no data, keeping it between these bounds (in microseconds).
+   */
+  static const uint32_t DEFAULT_MIN_POLL_INTERVAL = 1000;
+  static const uint32_t DEFAULT_MAX_POLL_INTERVAL = 10000;
+
+  /**
+   * Set the bounds for the poll interval, in microseconds. Only used
+   * in SPI mode without a data_ready pin.
+   */
+  void setPollInterval(uint32_t min, uint32_t max);
+
+  struct PollStats {
+    /** The current poll interval, in microseconds */
+    uint32_t interval;
+    /** The number of full polls done */
+    uint32_t full_polls;
+    /** The number of full polls that did not find any data */
+    uint32_t idle_polls;
+  };
+
+  /**
+   * Return statistics about polling the module for data. Only useful
+   * in SPI mode without a data_ready pin.
+   */
+  const PollStats& getPollStats() { return this->poll_stats; }
+
+  struct TxStats {
+    /** The number of bytes currently queued */
+    uint16_t queued;
+    /** The number of bytes sent to the module */
+    uint32_t sent;
+    /** The number of bytes dropped because the queue was full */
+    uint32_t dropped;
+    /** The number of pipelined data frames not yet acknowledged */
+    uint8_t frames_pending;
+    /** The number of pipelined data frames refused by the module */
+    uint16_t frames_failed;
+  };
+
+  /**
+   * Return statistics about data sent to the module. Only useful in
+   * SPI mode.
+   */
+  TxStats getTxStats();
+
 /*******************************************************
  * Methods for reading and writing data
  *******************************************************/
@@ -210,15 +456,17 @@ public:
   };
 
   /**
-   * Get info about the current frame (or, after reading the last byte of a
-   * frame, the next frame), without blocking.
+   * Get info about the current frame for the given cid (or, after
+   * reading the last byte of a frame, the next frame), without
+   * blocking.
    *
-   * @param cid    The cid the caller is interested in.
+   * @param cid    The cid the caller is interested in, or ANY_CID to
+   *               get the current frame for any cid (selected using
+   *               the RX policy, see setRxPolicy()).
    *
-   * @returns a pointer to the current frame if a frame was available
-   * and it contains data for the given cid (or cid is CID_ANY), or
-   * an empty frame (length == 0) when no frame is available or it is
-   * for the wrong cid.
+   * @returns the current frame, with length set to the number of bytes
+   * left to read, or an empty frame (length == 0) when no frame is
+   * available for the given cid.
    */
   RXFrame getFrameHeader(cid_t cid);
 
@@ -236,10 +484,11 @@ public:
   /**
    * Read a single byte of data for the given cid.
    *
-   * Be careful when polling this method for data. If data is available
-   * for another cid, then calling readData will _never_ return a data
-   * byte, not until you read all the data for that other cid (no matter
-   * how long you wait).
+   * Data is buffered separately for each cid, so data for other cids
+   * does not prevent reading data for this cid. However, data for
+   * other cids is buffered while looking for data for this cid, so if
+   * data for another cid is never read, it will eventually be dropped
+   * (see setRxBudget()).
    *
    * @param cid The cid to read data for. Can be an invalid cid, will
    *            return -1 then.
@@ -262,9 +511,55 @@ public:
    */
   size_t readData(cid_t cid, uint8_t *buf, size_t size);
 
+  struct DataSpan {
+    /** Pointer to the data */
+    const uint8_t *data;
+    /** Number of bytes available at data */
+    uint16_t len;
+  };
+
+  /**
+   * Get direct access to the buffered data for the current frame of
+   * the given cid, without copying it. The buffered data is returned
+   * as up to two spans of consecutive bytes, the data in the second
+   * span continues where the first span ends (but is not necessarily
+   * adjacent in memory). Bytes from the next frame are never returned.
+   * When more data is buffered than fits in two spans, call peekData()
+   * again after consumeData().
+   *
+   * The data stays in the buffer until it is removed using
+   * consumeData(). The spans are only valid until the next call to
+   * any other method of this class.
+   *
+   * @param cid    The cid to get data for. Can be an invalid cid, will
+   *               return 0 then.
+   * @param spans  An array of two spans that will be filled.
+   *
+   * @returns the number of spans filled (0, 1 or 2).
+   *
+   * @see the notes for readData(cid_t), which also apply here.
+   */
+  uint8_t peekData(cid_t cid, DataSpan spans[2]);
+
+  /**
+   * Remove bytes returned by peekData(cid_t, DataSpan*) from the
+   * buffer.
+   *
+   * @param cid    The cid to remove data for.
+   * @param len    The number of bytes to remove. Should not be more
+   *               than the total length of the spans returned by
+   *               peekData().
+   */
+  void consumeData(cid_t cid, uint16_t len);
+
   /**
    * Read a single byte of data, for any cid.
    *
+   * Once a byte of a frame is returned, the rest of that frame is
+   * returned before data for any other cid. When data is available for
+   * multiple cids, the RX policy decides which is returned first (see
+   * setRxPolicy()).
+   *
    * @param   cid   If the return value is not -1, the cid for which
    *                data was returned is returned through this pointer.
    *
@@ -286,6 +581,143 @@ public:
    */
   uint16_t availableData(cid_t cid);
 
+  enum RXPolicy {
+    /** Return data for each cid in turn */
+    GS_RX_ROUND_ROBIN,
+    /** Always return data for the lowest cid first */
+    GS_RX_LOWEST_CID_FIRST,
+  };
+
+  /**
+   * Set the order in which data for different cids is returned by
+   * readData(cid_t*), firstCidWithData() and getFrameHeader(ANY_CID).
+   * Defaults to GS_RX_ROUND_ROBIN.
+   */
+  void setRxPolicy(RXPolicy policy) { this->rx_policy = policy; }
+
+  /**
+   * Limit the amount of buffer space used for received data for the
+   * given cid. When more data is received for a cid than fits in its
+   * budget, the overflow policy decides what happens (see
+   * setRxOverflowPolicy()).
+   *
+   * By default, each cid can use the entire buffer. When the buffer is
+   * full, the cid that uses the most space is considered to be over
+   * its budget.
+   *
+   * @param cid    The cid to set the budget for, or ANY_CID to set the
+   *               budget for all cids.
+   * @param bytes  The budget, in bytes. Rounded up to a multiple of
+   *               RX_BLOCK_SIZE, at least one block is always allowed.
+   */
+  void setRxBudget(cid_t cid, uint16_t bytes);
+
+  enum RXOverflowPolicy {
+    /**
+     * Drop the oldest frame(s) of the cid that is over its budget. If
+     * the dropped frame is still being received, the rest of it is
+     * dropped as well.
+     */
+    GS_RX_DROP_OLDEST,
+    /**
+     * Drop an incoming frame when it does not fit in the budget of its
+     * cid. A frame is only accepted when no other data is buffered for
+     * its cid, or when it fits completely, so this never drops data
+     * for other cids. Note that frames that are bigger than the budget
+     * can only be received when the application reads them while they
+     * are received.
+     */
+    GS_RX_DROP_NEWEST,
+    /**
+     * Stop reading from the module until the application has read
+     * enough data. This makes the module apply flow control (e.g.,
+     * TCP windowing). Reading stops within a frame for a cid that is
+     * over its budget, or within its header when there is no room to
+     * store that. Replies and async events are always read.
+     *
+     * While waiting for a reply to a command or data frame, reading
+     * never stops, since the reply might be queued behind data. Any
+     * data that does not fit is then dropped like with
+     * GS_RX_DROP_OLDEST.
+     *
+     * Only supported in SPI mode: A UART keeps receiving when we stop
+     * reading, and then loses bytes.
+     */
+    GS_RX_BACKPRESSURE,
+  };
+
+  /**
+   * Set what happens when data is received for a cid that is over its
+   * budget. Defaults to GS_RX_DROP_OLDEST. In all cases, dropped frames
+   * and bytes are counted (see getRxStats()) and the error flag of the
+   * connection is set.
+   *
+   * @returns false when the policy is not supported (GS_RX_BACKPRESSURE
+   * in UART mode).
+   */
+  bool setRxOverflowPolicy(RXOverflowPolicy policy) {
+    if (policy == GS_RX_BACKPRESSURE && this->serial)
+      return false;
+    this->rx_overflow_policy = policy;
+    return true;
+  }
+
+  struct RxStats {
+    /** The number of bytes currently buffered, including frame headers */
+    uint16_t queued;
+    /** The number of frames (partially) dropped */
+    uint16_t dropped_frames;
+    /** The number of data bytes dropped */
+    uint32_t dropped_bytes;
+  };
+
+  /**
+   * Return statistics about data received for the given cid. Only
+   * valid cids should be passed.
+   */
+  RxStats getRxStats(cid_t cid);
+
+  /**
+   * Callback for received data, see setOnData().
+   *
+   * @param data   The eventData value.
+   * @param cid    The cid data was received for.
+   * @param frame  The current frame, with length set to the number of
+   *               bytes left to read, including the bytes in buf.
+   * @param buf    The received data, or NULL when no payload is
+   *               delivered.
+   * @param len    The number of bytes in buf.
+   */
+  typedef void (*data_callback_t)(void *data, cid_t cid, const RXFrame &frame, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Set a callback to be called from loop() when data is available for
+   * the given cid. When a callback is set, loop() also reads the rest
+   * of any frame the module is sending for this cid, so there is no
+   * need to poll availableData().
+   *
+   * When payload is false, the callback is called with only the frame
+   * header and should read the data itself, using readData() or
+   * peekData(). If it does not read anything, it is called again on
+   * the next loop().
+   *
+   * When payload is true, the callback is called with the buffered
+   * data, in one or more pieces per frame, and the data is consumed
+   * when the callback returns. The data is only valid until the
+   * callback does something that might read from the module (such as
+   * sending data or commands), so copy it first when needed. The
+   * callback should not read data for this cid itself.
+   *
+   * The callback is kept when the connection is closed, so pass NULL
+   * when the cid is no longer in use.
+   *
+   * @param cid      The cid to set the callback for, or ANY_CID to set
+   *                 it for all cids.
+   * @param callback The callback, or NULL to disable.
+   * @param payload  Whether to pass the data to the callback.
+   */
+  void setOnData(cid_t cid, data_callback_t callback, bool payload = false);
+
   /**
    * Write connection data for the given cid.
    *
@@ -315,6 +747,161 @@ public:
    */
   bool writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len);
 
+  /**
+   * Write connection data for the given cid, gathered from multiple
+   * buffers. This sends the same frames as a single writeData() call
+   * with all parts concatenated, so e.g. a protocol header and payload
+   * can be sent without copying them into a single buffer first.
+   *
+   * @param cid    The cid to write data to. Can be an invalid cid, will
+   *               return false then.
+   * @param parts  The buffers to send, in order.
+   * @param count  The number of entries in parts.
+   *
+   * @returns whether the data could be succesfully written.
+   */
+  bool writeDataV(cid_t cid, const DataSpan *parts, uint8_t count);
+
+  /**
+   * Write a packet for the given UDP server cid, gathered from
+   * multiple buffers. The combined length of all parts can be at most
+   * MAX_FRAME_SIZE.
+   *
+   * @see writeDataV(cid_t, const DataSpan*, uint8_t) and
+   *      writeData(cid_t, IPAddress, uint16_t, const uint8_t*, uint16_t)
+   */
+  bool writeDataV(cid_t cid, IPAddress ip, uint16_t port, const DataSpan *parts, uint8_t count);
+
+  struct Datagram {
+    /** The address to send the datagram to */
+    IPAddress ip;
+    /** The port to send the datagram to */
+    uint16_t port;
+    /** The payload, up to MAX_FRAME_SIZE bytes */
+    const uint8_t *data;
+    uint16_t len;
+    /** Set by writeDatagrams() when the module accepted the datagram */
+    bool ok;
+  };
+
+  /**
+   * Write a batch of packets for the given UDP server cid. Afterwards,
+   * the ok field of each datagram tells whether the module accepted
+   * it. Datagrams bigger than MAX_FRAME_SIZE are not sent.
+   *
+   * Unlike bulk data frames, UDP server frames are not pipelined:
+   * each one still waits for the module to accept its header, since
+   * the module might reply to the rest of the header with an extra
+   * <ESC>F, which would mess up matching the replies to frames.
+   *
+   * To send the same payload to many peers, just point all data
+   * fields to the same buffer.
+   *
+   * The results are not reported through onTxFrame.
+   *
+   * @param cid        The UDP server cid to write data to. Can be an
+   *                   invalid cid, will return 0 then.
+   * @param datagrams  The datagrams to send.
+   * @param count      The number of entries in datagrams.
+   *
+   * @returns the number of datagrams accepted by the module.
+   */
+  uint8_t writeDatagrams(cid_t cid, Datagram *datagrams, uint8_t count);
+
+  /**
+   * Write data for the given UDP server cid to a single destination,
+   * split into datagrams of (at most) segment bytes, like
+   * writeDatagrams().
+   *
+   * @param segment    The maximum size of each datagram. When 0 or
+   *                   bigger than MAX_FRAME_SIZE, MAX_FRAME_SIZE is
+   *                   used.
+   *
+   * @returns the number of datagrams accepted by the module. All data
+   * was sent when this equals len / segment, rounded up.
+   */
+  uint16_t writeDataSegmented(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len, uint16_t segment);
+
+  /**
+   * Callback for writeDataAsync().
+   *
+   * @param data   The data passed to writeDataAsync().
+   * @param cid    The cid the data was written to.
+   * @param ok     Whether the module accepted the data.
+   */
+  typedef void (*write_callback_t)(void *data, cid_t cid, bool ok);
+
+  /**
+   * Write connection data for the given cid, without waiting for the
+   * module. The write is queued and sent by loop(), a bit at a time
+   * (so a slow module does not block loop() for long). When the module
+   * acknowledged or refused the data, the callback is called from
+   * loop().
+   *
+   * buf must stay valid until the callback is called.
+   *
+   * Writes are sent in order. When other data or commands are written
+   * while asynchronous writes are queued, the queued writes are sent
+   * first, blocking as needed.
+   *
+   * Frames are always sent pipelined (see setTxPipeline()), so when
+   * the module refuses a frame, it interprets the rest of it as
+   * commands. To prevent this, only connected cids are accepted, and
+   * a queued write for a cid that is disconnected before its frame is
+   * started fails without being sent. A connection closed by the
+   * remote side while the frame is being sent can still cause this,
+   * so avoid data that looks like a command on connections that might
+   * be closed.
+   *
+   * @param cid      The cid to write data to.
+   * @param buf      The data to send.
+   * @param len      The number of bytes to send, at most
+   *                 MAX_FRAME_SIZE.
+   * @param callback Called when the write is complete, can be NULL.
+   * @param data     Passed to callback.
+   *
+   * @returns false when the write could not be queued, because the
+   * cid is invalid or not connected, len is too big or
+   * ASYNC_WRITE_QUEUE_SIZE writes are already queued. The callback is
+   * not called then.
+   */
+  bool writeDataAsync(cid_t cid, const uint8_t *buf, uint16_t len, write_callback_t callback, void *data);
+
+  /**
+   * Set how many data frames can be sent without waiting for the module
+   * to acknowledge them.
+   *
+   * Normally, writeData() waits for the module to acknowledge every
+   * frame before sending its length and data, which costs a round
+   * trip per frame (and per 1400 bytes). In pipelined mode, the entire
+   * frame is sent right away and acknowledgements are matched to
+   * frames as they come in. writeData() then only waits when depth
+   * frames are still unacknowledged.
+   *
+   * Since writeData() returns before the frame is acknowledged, its
+   * return value no longer tells whether the module accepted the
+   * frame. Instead, use the onTxFrame event handler or getTxStats(). If
+   * the module refuses a frame, the rest of that frame is not
+   * interpreted as data by the module, so only use this mode for cids
+   * that are known to be connected.
+   *
+   * UDP server frames are always sent without pipelining.
+   *
+   * @param depth  The number of frames that can be unacknowledged, up
+   *               to TX_PIPELINE_SIZE. 0 (the default) disables
+   *               pipelining.
+   */
+  void setTxPipeline(uint8_t depth);
+
+  /**
+   * Wait until all frames sent in pipelined mode have been
+   * acknowledged by the module.
+   *
+   * @returns true when all frames were acknowledged, false on a
+   * timeout.
+   */
+  bool flushTxFrames() { return waitTxFrames(0); }
+
 /*******************************************************
  * Methods for getting connection info
  *******************************************************/
@@ -411,12 +998,68 @@ public:
     // code to comunicate between different parts of the code.
     GS_UNKNOWN_RESPONSE,
     GS_UNRECOVERABLE_ERROR,
+    GS_RESPONSE_TIMEOUT,
+  };
+
+  /**
+   * Classes of commands that use a different response timeout. See
+   * setTimeout().
+   */
+  enum GSTimeout {
+    // Configuration commands that are handled right away
+    GS_TIMEOUT_CONFIG,
+    // Commands that read or write flash, like AT&V
+    GS_TIMEOUT_FLASH,
+    // Associating to an access point, including DHCP and calculating
+    // a WPA PSK
+    GS_TIMEOUT_ASSOCIATE,
+    // DNS lookups
+    GS_TIMEOUT_DNS,
+    // Opening a TCP connection
+    GS_TIMEOUT_CONNECT,
+    // TLS handshake
+    GS_TIMEOUT_TLS,
+
+    GS_TIMEOUT_COUNT,
   };
 
+  /**
+   * Set the response timeout used for a class of commands. All
+   * GSModule methods select the appropriate class automatically, other
+   * commands use GS_TIMEOUT_CONFIG unless setNextTimeout() is used.
+   *
+   * When a command times out, GS_RESPONSE_TIMEOUT is returned. The
+   * response might still arrive later or might have been lost, so
+   * before the next command is sent, an "AT" marker command is sent
+   * and all responses up to and including the one to the marker are
+   * skipped. If the marker is not answered either, the module is
+   * considered unresponsive and an unrecoverable error is flagged.
+   *
+   * @param timeout  The class of commands.
+   * @param ms       The timeout in milliseconds.
+   */
+  void setTimeout(GSTimeout timeout, uint32_t ms)
+  {
+    if (timeout < GS_TIMEOUT_COUNT)
+      this->timeouts[timeout] = ms;
+  }
+
+  /**
+   * Override the response timeout for the next command sent (through
+   * writeCommand(), writeCommandAsync() or any of the GSModule
+   * methods).
+   *
+   * @param ms       The timeout in milliseconds.
+   */
+  void setNextTimeout(uint32_t ms) { this->next_timeout = ms; }
+
   /**
    * Send a command to the module. Accepts a format string and arguments
-   * like printf. The string is sent as-is, so it should contain the
-   * trailing \r\n already.
+   * like printf, see formatCommand() for the supported conversions.
+   * The trailing \r\n is added automatically.
+   *
+   * The command is formatted and written to the module piece by piece,
+   * so there is no limit on its length.
    */
   void writeCommand(const char *fmt, ...);
   void writeCommand(const char *fmt, va_list args);
@@ -424,8 +1067,7 @@ public:
   /**
    * Send a command to the module and reads a reply.
    *
-   * Accepts a format string and arguments like printf. The string is
-   * sent as-is, so it should contain the trailing \r\n already.
+   * Accepts a format string and arguments like writeCommand().
    *
    * @returns true when an OK response was received, false in all other
    *          cases.
@@ -452,8 +1094,8 @@ public:
    *                       numerical cid sent by the module.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          when no response was read within the timeout for the
+   *          last command sent (see setTimeout()).
    */
   GSResponse readResponse(uint8_t *buf, uint16_t *len, cid_t *connect_cid = NULL);
 
@@ -466,8 +1108,8 @@ public:
    *                       numerical cid sent by the module.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          when no response was read within the timeout for the
+   *          last command sent (see setTimeout()).
    */
   GSResponse readResponse(cid_t *connect_cid = NULL);
 
@@ -488,8 +1130,8 @@ public:
    *                       is then not passed to the callback.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          when no response was read within the timeout for the
+   *          last command sent (see setTimeout()).
    *
    * Within the callback, no new commands should be sent to the module,
    * since that will cause deadlocks and/or other unexpected behaviour.
@@ -499,6 +1141,56 @@ public:
    */
   GSResponse readResponse(line_callback_t callback, void *data, cid_t *connect_cid = NULL);
 
+  /**
+   * Callback for writeCommandAsync().
+   *
+   * @param data         The data passed to writeCommandAsync().
+   * @param res          The code for the final response line, or
+   *                     GS_RESPONSE_TIMEOUT when no response was read
+   *                     within the timeout (see setTimeout()).
+   * @param connect_cid  The cid from a "CONNECT <CID>" reply, or
+   *                     INVALID_CID when there was none.
+   */
+  typedef void (*command_callback_t)(void *data, GSResponse res, cid_t connect_cid);
+
+  /**
+   * Send a command to the module, without waiting for the reply. The
+   * command is queued and sent by loop(), which also reads the reply
+   * bit by bit, so data for open connections keeps flowing while the
+   * module is busy with the command.
+   *
+   * Commands are sent one at a time, in order. Before a blocking
+   * command (writeCommand(), writeCommandCheckOk(), or any of the
+   * GSModule methods) is sent, all queued commands are completed
+   * first, blocking as needed.
+   *
+   * @param line_callback  Called for every line of data in the reply
+   *                       (e.g., that doesn't look like a known
+   *                       response), can be NULL. See readResponse().
+   * @param callback       Called when the final response line is
+   *                       read, can be NULL.
+   * @param data           Passed to both callbacks.
+   * @param fmt            Format string for the command, without
+   *                       the trailing \r\n. See formatCommand().
+   *
+   * @returns false when the command could not be queued, because
+   * COMMAND_QUEUE_SIZE commands are already queued or there is no
+   * room left for the command text (see COMMAND_TEXT_SIZE). The
+   * callbacks are not called then.
+   *
+   * Both callbacks are called from loop(). They should not call
+   * blocking methods, since that would block loop() as well.
+   */
+  bool writeCommandAsync(line_callback_t line_callback, command_callback_t callback, void *data, const char *fmt, ...);
+
+  /**
+   * Wait until all commands queued by writeCommandAsync() have been
+   * completed and their callbacks have been called.
+   *
+   * @returns true when successful, false on a timeout.
+   */
+  bool flushCommands();
+
   /**
    * Read a single data response (e.g. <Esc>O or <Esc>F in response to a
    * data transmission escape sequence).
@@ -511,6 +1203,12 @@ public:
   /**
    * Write a raw sequence of bytes.
    *
+   * In SPI mode, when the module sent XOFF, the data is put into a
+   * queue instead, which is sent by loop() and readRaw() once the
+   * module sends XON. Only when the queue is full, this method waits
+   * for the module, and when that takes too long, the remaining data
+   * is dropped (and counted in getTxStats()).
+   *
    * You should not normally use this method, instead use either
    * writeCommand() or writeData().
    */
@@ -519,11 +1217,24 @@ public:
   /**
    * Reads a single byte from the module, or returns -1 when no byte is available.
    *
+   * When the overflow policy is GS_RX_BACKPRESSURE and there is no room
+   * to buffer received data, this also returns -1 (see rxBlocked()).
+   *
    * You should not normally use this method, instead use either
    * readResponse() or readData().
    */
   int readRaw();
 
+  /**
+   * Processes a block of bytes read from the module. This is
+   * equivalent to processing the bytes one by one, but copies the data
+   * inside a data frame in one go, which is a lot faster.
+   *
+   * You should not normally use this method, readData() and friends
+   * take care of reading and processing data.
+   */
+  void processIncoming(const uint8_t *buf, size_t len);
+
 /*******************************************************
  * Helper methods
  *******************************************************/
@@ -541,57 +1252,452 @@ public:
    */
   static bool parseIpAddress(IPAddress *ip, const char *str, uint16_t len = 0);
 
-/*******************************************************
- * Internal helper methods
- *******************************************************/
-protected:
-  enum RXState {
-    /** Default state: expecting (more of) an async response */
-    GS_RX_IDLE,
-    /** Read an escape char, waiting for the type */
-    GS_RX_ESC,
-    /** Read an <esc>Z escape code, reading the rest of the sequence */
-    GS_RX_ESC_Z,
-    /** Read an <esc>y escape code, reading ip address */
-    GS_RX_ESC_y_1,
-    /** Read an <esc>y escape code, reading port */
-    GS_RX_ESC_y_2,
-    /** Read an <esc>y escape code, reading length */
-    GS_RX_ESC_y_3,
-    /** Reading bulk data */
-    GS_RX_BULK,
-    /** Read an <esc>A escape code, waiting for the rest of the sequence */
-    GS_RX_ESC_A,
-    /** Reading async data */
-    GS_RX_ASYNC,
-  };
-
   /**
-   * Setup function common for UART and SPI modes.
+   * Formats an ip address in dotted-quad notation, followed by a \0.
+   * This is a lot faster than snprintf.
+   *
+   * @param dst    The buffer to write to, should be at least 16 bytes.
+   * @param ip     The address to format.
+   * @returns the number of characters written, excluding the \0.
    */
-  bool _begin();
+  static uint8_t formatIpAddress(char *dst, const IPAddress &ip);
 
   /**
-   * Processes special characters in the given byte, as received through
-   * SPI. Returns the original byte, or -1 when there is none.
+   * Formats a number in decimal, followed by a \0.
+   *
+   * @param dst    The buffer to write to, should be at least 6 bytes.
+   * @param value  The number to format (e.g. a port number).
+   * @returns the number of characters written, excluding the \0.
    */
-  int processSpiSpecial(uint8_t c);
+  static uint8_t formatNumber(char *dst, uint16_t value);
 
   /**
-   * Checks wether an SPI byte is special and should be escaped when
-   * sent.
+   * Formats a number as exactly four decimal digits, zero padded, as
+   * used for the length in bulk data frames. No \0 is written.
+   *
+   * @param dst    The buffer to write to, should be at least 4 bytes.
+   * @param value  The number to format, should be below 10000.
    */
-  bool isSpiSpecial(uint8_t c);
+  static void formatLength(char *dst, uint16_t value);
 
   /**
-   * Send and receive a single SPI byte.
+   * Returns the (lowercase) hex digit for the given value, as used for
+   * the cid in commands and bulk data frames.
+   *
+   * @param value  The value to format, should be below 16.
    */
-  uint8_t transferSpi(uint8_t c);
+  static char formatHexDigit(uint8_t value) { return value < 10 ? '0' + value : 'a' + value - 10; }
 
   /**
-   * Processes an incoming byte read from the module.
+   * Formats a command and writes it to the given Print, in pieces.
+   * This supports a subset of printf:
+   *  - %d and %i for signed numbers, %u for unsigned numbers and %x
+   *    and %X for hexadecimal numbers. With the l modifier (e.g. %lu),
+   *    these expect a long argument.
+   *  - %c for a single character and %s for a string.
+   *  - %q for a string, with double quotes and backslashes escaped by
+   *    a backslash, for use inside a quoted argument (e.g. an SSID or
+   *    passphrase).
+   *  - %% for a literal %.
+   * A width (e.g. %02x or %-5s) pads the value with spaces, or with
+   * zeroes for the 0 flag, and is ignored for %q. A precision limits
+   * the length of a %s string and is ignored otherwise. Both can be
+   * given as * to take them from the arguments. Any other conversion
+   * or flag stops formatting, since its argument cannot be skipped.
    *
-   * @return true when a valid byte was passed, false when c was -1.
+   * @param out    Where to write the command.
+   * @param fmt    The format string.
+   * @param args   The arguments for the format string.
+   * @returns the number of characters written.
+   */
+  static size_t formatCommand(Print &out, const char *fmt, va_list args);
+
+  typedef void (*setting_callback_t)(const uint8_t *buf, uint16_t len, void *data);
+
+  /**
+   * Parses a line of AT&V output, calling the callback for every
+   * setting in it (e.g. "E0" or "+NDHCP=1"). Settings are separated by
+   * spaces, but quoted values (e.g. an SSID) can contain spaces.
+   *
+   * AT&V shows the current profile first, followed by the stored
+   * profiles. Only settings from the current profile are passed to the
+   * callback.
+   *
+   * @param buf       The line to parse.
+   * @param len       The length of the line.
+   * @param profiles  Counts the profile headers seen, should be 0
+   *                  before parsing the first line.
+   * @param callback  Called for every setting.
+   * @param data      Passed to the callback.
+   */
+  static void parseSettingsLine(const uint8_t *buf, uint16_t len, uint8_t *profiles, setting_callback_t callback, void *data);
+
+  /**
+   * Escapes a buffer of data for sending through SPI.
+   *
+   * You should not normally use this method, writeRaw() takes care of
+   * this already.
+   *
+   * @param src    The data to escape.
+   * @param len    The number of bytes in src.
+   * @param dst    The buffer to write the escaped data to. Should be at
+   *               least 2 * len bytes long.
+   *
+   * @returns the number of bytes written to dst.
+   */
+  static uint16_t encodeSpi(const uint8_t *src, uint16_t len, uint8_t *dst);
+
+  /**
+   * Processes a buffer of raw bytes received through SPI. Special
+   * characters (idle, xon / xoff, etc.) are processed and removed,
+   * escaped bytes are unescaped. The escape state is kept between
+   * calls, so a buffer can be split at any point.
+   *
+   * You should not normally use this method, readRaw() takes care of
+   * this already.
+   *
+   * @param src    The raw bytes received.
+   * @param len    The number of bytes in src.
+   * @param dst    The buffer to write the data bytes to. Should be at
+   *               least len bytes long. Can be the same as src.
+   *
+   * @returns the number of bytes written to dst.
+   */
+  uint16_t decodeSpi(const uint8_t *src, uint16_t len, uint8_t *dst);
+
+/*******************************************************
+ * Internal helper methods
+ *******************************************************/
+protected:
+  enum RXState {
+    /** Default state: expecting (more of) an async response */
+    GS_RX_IDLE,
+    /** Read an escape char, waiting for the type */
+    GS_RX_ESC,
+    /** Read an <esc>Z escape code, reading the rest of the sequence */
+    GS_RX_ESC_Z,
+    /** Read an <esc>y escape code, reading ip address */
+    GS_RX_ESC_y_1,
+    /** Read an <esc>y escape code, reading port */
+    GS_RX_ESC_y_2,
+    /** Read an <esc>y escape code, reading length */
+    GS_RX_ESC_y_3,
+    /** Reading bulk data */
+    GS_RX_BULK,
+    /** Read an <esc>A escape code, waiting for the rest of the sequence */
+    GS_RX_ESC_A,
+    /** Reading async data */
+    GS_RX_ASYNC,
+  };
+
+  struct RXQueue {
+    /** The block data is read from, or RX_NO_BLOCK when empty */
+    uint8_t first;
+    /** The block data is written to */
+    uint8_t last;
+    /** The offset into the first block where the next byte should be read from */
+    uint8_t read;
+    /** The offset into the last block where the next byte should be written to */
+    uint8_t write;
+    /** The number of blocks in the chain */
+    uint8_t blocks;
+    /** The maximum number of blocks in the chain */
+    uint8_t budget;
+    /** The number of bytes left to read from the current frame */
+    uint16_t left;
+    /** Whether the current frame is a UDP server frame */
+    bool udp_server;
+    /** Remote port of the current frame, for UDP server frames only */
+    uint16_t port;
+    /** Remote IP of the current frame, for UDP server frames only */
+    uint32_t ip;
+    /** The number of frames dropped, see RxStats */
+    uint16_t dropped_frames;
+    /** The number of bytes dropped, see RxStats */
+    uint32_t dropped_bytes;
+    /** Callback for received data, see setOnData() */
+    data_callback_t on_data;
+    /** Whether to pass the payload to on_data */
+    bool on_data_payload;
+  };
+
+  /** Marks the end of a chain of blocks */
+  static const uint8_t RX_NO_BLOCK = 0xff;
+
+  /** Size of a frame header in rx_data, see bufferFrameHeader() */
+  static const uint8_t RX_HEADER_SIZE = 2;
+  /** Size of a UDP server frame header in rx_data */
+  static const uint8_t RX_UDP_HEADER_SIZE = 8;
+  /**
+   * Set in the length of a frame header for UDP server frames. Frames
+   * are never this big, since their length has only four decimal
+   * digits.
+   */
+  static const uint16_t RX_HEADER_UDP_FLAG = 0x8000;
+
+  /**
+   * The buffers needed by GSCore, see the corresponding instance
+   * variables for their meaning.
+   */
+  template <uint16_t RxSize, uint8_t MaxCid, uint8_t SpiRxSize, uint8_t TxQueueSize>
+  struct Buffers {
+    uint8_t rx_data[RxSize];
+    uint8_t rx_block_next[RxSize / RX_BLOCK_SIZE];
+    RXQueue rx_queues[MaxCid + 1];
+    ConnectionInfo connections[MaxCid + 1];
+    uint8_t spi_rx_buf[SpiRxSize];
+    uint8_t tx_queue[TxQueueSize];
+  };
+
+  /**
+   * Holds the Buffers for GSCoreT and GSModuleT. It is listed as a
+   * base class before GSCore, so the buffers are constructed (and
+   * zeroed) before the GSCore constructor initializes them.
+   */
+  template <uint16_t RxSize, uint8_t MaxCid, uint8_t SpiRxSize, uint8_t TxQueueSize>
+  struct BufferHolder {
+    BufferHolder() : buffers() { }
+
+    Buffers<RxSize, MaxCid, SpiRxSize, TxQueueSize> buffers;
+  };
+
+  /**
+   * Set up this instance to use the given buffers, which must be
+   * constructed already (see BufferHolder).
+   */
+  template <class B>
+  GSCore(B &buffers)
+  {
+    // Check that the buffer sizes are a power of two, which makes all
+    // modulo operations efficient bitwise ands.
+    static_assert( is_power_of_two(sizeof(buffers.rx_data)), "rx_data size is not a power of two" );
+    static_assert( sizeof(buffers.rx_data) >= RX_BLOCK_SIZE, "rx_data is smaller than a single block" );
+    static_assert( lengthof(buffers.rx_block_next) < RX_NO_BLOCK, "too many blocks in rx_data" );
+    static_assert( lengthof(buffers.connections) <= MAX_CID + 1, "too many cids" );
+    static_assert( is_power_of_two(sizeof(buffers.spi_rx_buf)), "spi_rx_buf size is not a power of two" );
+    static_assert( sizeof(buffers.spi_rx_buf) >= 2 * SPI_BLOCK_SIZE, "spi_rx_buf is smaller than a single block" );
+    static_assert( is_power_of_two(sizeof(buffers.tx_queue)), "tx_queue size is not a power of two" );
+
+    this->rx_data = buffers.rx_data;
+    this->rx_block_next = buffers.rx_block_next;
+    this->rx_block_count = lengthof(buffers.rx_block_next);
+    this->rx_queues = buffers.rx_queues;
+    this->connections = buffers.connections;
+    this->max_cid = lengthof(buffers.connections) - 1;
+    this->spi_rx_buf = buffers.spi_rx_buf;
+    this->spi_rx_buf_size = sizeof(buffers.spi_rx_buf);
+    this->tx_queue = buffers.tx_queue;
+    this->tx_queue_size = sizeof(buffers.tx_queue);
+    init();
+  }
+
+  /**
+   * Constructor code that does not depend on the buffer sizes.
+   */
+  void init();
+
+  /**
+   * Setup function common for UART and SPI modes.
+   */
+  bool _begin();
+
+  /**
+   * Wait for the module to print its startup banner and discard it.
+   *
+   * @returns true when successful, false on a timeout.
+   */
+  bool waitForBanner();
+
+  /**
+   * Send the setup commands for all settings not in done (bits for
+   * entries in setup_commands), all at once, then read all responses.
+   *
+   * @returns true when all commands were successful.
+   */
+  bool sendSetupCommands(uint8_t done);
+
+  /**
+   * Check that the module responds to commands, after switching baud
+   * rates. Any data garbled by the switch is discarded.
+   *
+   * @returns true when the module responded.
+   */
+  bool probeLink();
+
+  /**
+   * Query the module settings, for fast start.
+   *
+   * @param done    Set to the setup commands that are not needed (bits
+   *                for entries in setup_commands).
+   * @param banner  Set to true when a startup banner was seen.
+   * @returns true when the module replied.
+   */
+  bool probeModule(uint8_t *done, bool *banner);
+
+  /**
+   * After a fast start found the module running already, find out if
+   * it is associated and which connections are open (using AT+NSTAT=?
+   * and AT+CID=?). When that fails, or the module is not associated,
+   * all connections are closed instead.
+   *
+   * @returns true when successful.
+   */
+  bool restoreState();
+
+  /**
+   * Line callback for AT+CID=?, which marks every cid listed as
+   * connected. data should point to the GSCore.
+   */
+  static void parseCidLine(const uint8_t *buf, uint16_t len, void *data);
+
+  /**
+   * Send and receive a block of SPI bytes, using a single SPI
+   * transaction. The received bytes are processed by
+   * processSpiIncoming() before the transaction ends.
+   *
+   * @param out    The (already escaped) bytes to send.
+   * @param in     Used as temporary storage for the received bytes.
+   *               Can not be the same buffer as out. Afterwards, it
+   *               contains any bytes returned by processSpiIncoming().
+   * @param len    The number of bytes to transfer, at most
+   *               2 * SPI_BLOCK_SIZE.
+   *
+   * @returns the number of bytes that did not fit in spi_rx_buf. These
+   *          are returned in the in buffer and should be passed to
+   *          processIncoming() by the caller.
+   */
+  uint8_t transferSpi(const uint8_t *out, uint8_t *in, uint8_t len);
+
+  /**
+   * Process a block of raw bytes received through SPI. Special
+   * characters are processed and the remaining data bytes are put into
+   * spi_rx_buf, to be returned by readRaw().
+   *
+   * If spi_rx_buf is full, the oldest bytes are removed from it to make
+   * room and written to the in buffer.
+   *
+   * @returns the number of bytes removed from spi_rx_buf.
+   */
+  uint8_t processSpiIncoming(uint8_t *in, uint8_t len);
+
+  /**
+   * Escape and send a block of data through SPI and process any bytes
+   * received.
+   *
+   * @param len    The number of bytes to send, at most SPI_BLOCK_SIZE.
+   */
+  void writeSpi(const uint8_t *buf, uint8_t len);
+
+  /**
+   * Put data into tx_queue.
+   *
+   * @returns the number of bytes queued, which is less than len when
+   * tx_queue is full.
+   */
+  uint16_t queueTx(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Send data from tx_queue to the module, until the queue is empty or
+   * the module sends XOFF. When the module has sent XOFF already, a
+   * single idle byte is sent to see if it has sent XON yet.
+   */
+  void drainTx();
+
+  /**
+   * Read data from the module into spi_rx_buf, for as long as the
+   * data_ready pin is high and there is room in spi_rx_buf. Called from
+   * the data_ready interrupt.
+   */
+  void pumpSpi();
+
+  /** Interrupt handler for the data_ready pin */
+  static void rxInterrupt();
+
+  /**
+   * Check whether an error can be logged to the error output. Inside
+   * the rx interrupt, errors are only counted and loop() reports how
+   * many were suppressed.
+   */
+  bool canLogError();
+
+  /**
+   * Write the header of a bulk data frame for the given cid (waiting
+   * for the module to accept it, unless in pipelined mode). The caller
+   * should write len bytes of data afterwards.
+   */
+  bool writeFrameHeader(cid_t cid, uint16_t len);
+
+  /**
+   * Write len bytes from the given parts, starting at offset into the
+   * first part. Afterwards, *parts and *offset point to the first
+   * byte that was not written.
+   */
+  void writeParts(const DataSpan **parts, uint16_t *offset, uint16_t len);
+
+  /** Room needed for a UDP server frame header */
+  static const uint8_t UDP_HEADER_SIZE = 3 + 15 + 1 + 5 + 1 + 4 + 1;
+
+  /**
+   * Format the header for a UDP server frame (<ESC>Y...) into header,
+   * which should be UDP_HEADER_SIZE bytes long. No \0 is written.
+   *
+   * @returns the length of the header.
+   */
+  uint8_t formatUdpHeader(char *header, cid_t cid, IPAddress ip, uint16_t port, uint16_t len);
+
+  /**
+   * Process incoming data until at most the given number of pipelined
+   * data frames are unacknowledged.
+   *
+   * @returns true when successful, false on a timeout.
+   */
+  bool waitTxFrames(uint8_t max_pending);
+
+  /**
+   * Call onTxFrame or the writeDataAsync() callback for all
+   * acknowledged frames.
+   */
+  void reportTxFrames();
+
+  /** A write queued by writeDataAsync() */
+  struct AsyncWrite {
+    cid_t cid;
+    const uint8_t *buf;
+    uint16_t len;
+    /** Number of bytes (of the header and data) written so far */
+    uint16_t sent;
+    write_callback_t callback;
+    void *data;
+  };
+
+  /**
+   * Send writes queued by writeDataAsync().
+   *
+   * @param finish   When false, send only as much as possible without
+   *                 blocking (up to ASYNC_WRITE_BUDGET bytes). When
+   *                 true, send all queued writes, blocking when
+   *                 needed.
+   */
+  void sendAsyncWrites(bool finish);
+
+  /**
+   * Send (part of) a single write queued by writeDataAsync(). See
+   * sendAsyncWrites().
+   *
+   * @returns true when the write was sent completely.
+   */
+  bool sendAsyncWrite(AsyncWrite &w, bool finish, uint16_t *budget);
+
+  /** The maximum number of bytes sendAsyncWrites() sends per call */
+  static const uint16_t ASYNC_WRITE_BUDGET = 256;
+
+  /** Size of the header of a bulk data frame (<ESC>Z...) */
+  static const uint8_t FRAME_HEADER_SIZE = 7;
+
+  /**
+   * Processes an incoming byte read from the module.
+   *
+   * @return true when a valid byte was passed, false when c was -1.
    *
    * @param c              The byte to process. If it is -1, does
    *                       nothing and retruns false.
@@ -599,28 +1705,153 @@ protected:
   bool processIncoming(int c);
 
   /**
-   * Put an incoming data byte into rx_data.
+   * Call the on_data callbacks for all cids that have data available.
+   * Called by loop().
+   */
+  void dispatchData();
+
+  /**
+   * How often dispatchData() calls a callback or reads from the module
+   * for a single cid, so a busy connection cannot keep loop() busy
+   * forever.
    */
-  void bufferIncomingData(uint8_t c);
+  static const uint8_t MAX_DISPATCH_ROUNDS = 32;
 
   /**
-   * Puts a frame header into rx_data.
+   * Reads a byte from the module and, unless the overflow policy is
+   * GS_RX_BACKPRESSURE, any further bytes that are already available
+   * without polling the module, and processes them. In SPI mode,
+   * payload is copied from spi_rx_buf into the receive queue directly.
+   *
+   * @return true when at least one byte was processed, false when no
+   *         byte was available.
+   */
+  bool pumpIncoming();
+
+  /**
+   * Copy payload bytes of the frame being received from spi_rx_buf
+   * into the receive queue, up to the end of the ringbuffer. Should
+   * only be called in the GS_RX_BULK state, when spi_rx_buf is not
+   * empty.
+   *
+   * @returns the number of bytes copied, at most max.
+   */
+  uint8_t pumpSpiPayload(uint8_t max);
+
+  /**
+   * Put incoming data bytes into the queue for head_frame.cid. All
+   * bytes must be part of head_frame.
+   */
+  void bufferIncomingData(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Puts a frame header into the queue for frame->cid, using
+   * RX_HEADER_SIZE or RX_UDP_HEADER_SIZE bytes.
    */
   void bufferFrameHeader(const RXFrame *frame);
 
   /**
-   * Loads a frame header from rx_data. Should not be called when
-   * rx_data is empty.
+   * Loads a frame header from the queue for the given cid. Should only
+   * be called when the current frame for the cid is finished (left ==
+   * 0) and the queue is not empty.
+   */
+  void loadFrameHeader(cid_t cid, RXFrame *frame);
+
+  /**
+   * Make sure the current frame for the given cid has data left,
+   * loading the next frame header when needed, either from the queue
+   * for the cid or by querying the module (without blocking).
+   *
+   * @returns true when a frame with data left is available.
+   */
+  bool startFrame(cid_t cid);
+
+  /**
+   * Find the cid to return data for when ANY_CID is passed, according
+   * to rx_policy, and make sure its current frame has data left.
+   *
+   * @returns the cid, or INVALID_CID when no data is available.
+   */
+  cid_t nextCidWithData();
+
+  /**
+   * Read data from the current frame for the given cid, either from
+   * its queue or directly from the module, without blocking. Should
+   * only be called after startFrame() returned true.
+   *
+   * @param buf    The buffer to store the data in.
+   * @param len    The maximum number of bytes to read.
+   *
+   * @returns the number of bytes read.
+   */
+  uint16_t readFrameData(cid_t cid, uint8_t *buf, uint16_t len);
+
+  /**
+   * @returns the number of bytes (data and frame headers) in the queue
+   * for the given cid.
+   */
+  uint16_t queuedData(cid_t cid);
+
+  /**
+   * @returns the number of bytes that can be added to the queue for
+   * the given cid without dropping data.
+   */
+  uint16_t queueRoom(cid_t cid);
+
+  /**
+   * Drop data according to rx_overflow_policy, until at least len
+   * bytes can be added to the queue for the given cid.
+   *
+   * @returns false when no room could be made, or the frame being
+   * received was dropped to make room.
+   */
+  bool makeRoom(cid_t cid, uint8_t len);
+
+  /**
+   * Should readRaw() stop reading from the module, because there is no
+   * room for the data? Only when rx_overflow_policy is
+   * GS_RX_BACKPRESSURE and nobody is waiting for a reply.
+   */
+  bool rxBlocked();
+
+  /**
+   * Set while readDataResponse() waits for the module to accept a data
+   * frame, so rxBlocked() does not stop reading. Pipelined frames are
+   * tracked by tx_frames instead.
+   */
+  bool rx_waiting = false;
+
+  /**
+   * Add data to the queue for the given cid. makeRoom() should be
+   * called first.
    */
-  void loadFrameHeader(RXFrame *frame);
+  void enqueueData(cid_t cid, const uint8_t *buf, uint16_t len);
 
   /**
-   * Get the next data byte, without blocking. The frame is loaded
-   * either from rx_data or by querying the module.
+   * Remove data (or frame headers) from the queue for the given cid.
+   *
+   * @param buf    The buffer to store the data in, or NULL to discard
+   *               the data.
    *
-   * @returns the data byte, or -1 when no data is available.
+   * @returns the number of bytes removed, which is less than len when
+   * the queue runs empty.
    */
-  int getData();
+  uint16_t dequeueData(cid_t cid, uint8_t *buf, uint16_t len);
+
+  /**
+   * Take a block from the free list and add it to the end of the queue
+   * for the given cid.
+   *
+   * @returns false when no block is free or the cid has used up its
+   * budget.
+   */
+  bool allocRxBlock(cid_t cid);
+
+  /**
+   * Remove the first block from the queue for the given cid and put it
+   * back on the free list.
+   */
+  void freeRxBlock(cid_t cid);
 
   /**
    * Read and process any async responses available.
@@ -628,10 +1859,137 @@ protected:
   void readAndProcessAsync();
 
   /**
-   * Drop a byte from the tail of rx_data, to make room for incoming
-   * data and mark the affected cid as broken.
+   * Drop the oldest frame for the given cid (or the rest of the
+   * current frame, if the application started reading it already), to
+   * make room for incoming data and mark the cid as broken. If the
+   * frame is still being received, the rest of it is dropped as it
+   * arrives.
+   *
+   * @returns false when there was no frame to drop.
+   */
+  bool dropFrame(cid_t cid);
+
+  /**
+   * Drop the frame that is being received (head_frame), before its
+   * header was put into the queue.
+   */
+  void dropIncomingFrame(cid_t cid);
+
+  /** State of the response line parser, see processResponseByte() */
+  struct ResponseState {
+    /** Buffer for the response lines, see readResponseInternal() */
+    uint8_t *buf;
+    uint16_t size;
+    /** Number of bytes in buf */
+    uint16_t read;
+    /** Start of the current line in buf */
+    uint16_t line_start;
+    cid_t *connect_cid;
+    bool keep_data;
+    line_callback_t callback;
+    void *data;
+    bool dropped_data;
+    bool skip_line;
+    /**
+     * The final response, or GS_UNKNOWN_RESPONSE while it has not been
+     * read yet
+     */
+    GSResponse res;
+  };
+
+  /**
+   * Prepare the response line parser for reading a new response.
+   * Any bytes received while the parser is active (in rx_response) are
+   * passed to processResponseByte() by processIncoming(). See
+   * readResponseInternal() for the parameters.
+   */
+  void startResponse(ResponseState *state, uint8_t *buf, uint16_t len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data);
+
+  /**
+   * Process a single byte of a response, outside of escape sequences.
+   * When this byte completes the final response line, state->res is
+   * set and the parser is deactivated.
+   */
+  void processResponseByte(ResponseState *state, uint8_t c);
+
+  /**
+   * Send the next command queued by writeCommandAsync() and call the
+   * callback for the command that completed, if any.
+   */
+  void processCommands();
+
+  /**
+   * Write the text of a command, followed by \r\n.
+   */
+  void writeCommandLine(const uint8_t *buf, uint16_t len);
+
+  /** Print that writes straight to the module, see writeCommand() */
+  class CommandWriter : public Print {
+  public:
+    CommandWriter(GSCore *core) : core(core) { }
+    size_t write(uint8_t c) { this->core->writeRaw(&c, 1); return 1; }
+    size_t write(const uint8_t *buf, size_t len) { this->core->writeRaw(buf, len); return len; }
+  private:
+    GSCore *core;
+  };
+
+  /** Print that writes to a fixed buffer, see writeCommandAsync() */
+  class CommandBuffer : public Print {
+  public:
+    CommandBuffer(uint8_t *buf, size_t size) : buf(buf), size(size), len(0) { }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *data, size_t n)
+    {
+      if (n > this->size - this->len) {
+        setWriteError();
+        n = this->size - this->len;
+      }
+      memcpy(this->buf + this->len, data, n);
+      this->len += n;
+      return n;
+    }
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+  };
+
+  /**
+   * Select the timeout class for the next command sent, unless
+   * setNextTimeout() was called.
+   *
+   * @param extra   Added to the timeout, for commands that take a
+   *                timeout argument themselves.
+   */
+  void useTimeout(GSTimeout timeout, uint32_t extra = 0)
+  {
+    this->next_class_timeout = this->timeouts[timeout] + extra;
+  }
+
+  /**
+   * Returns the timeout for the command being sent and resets the
+   * selection made through useTimeout() and setNextTimeout().
    */
-  void dropData(uint8_t num_bytes);
+  uint32_t takeTimeout();
+
+  /**
+   * Handle a command that timed out: any responses that arrive are
+   * skipped until resync() finished, see setTimeout().
+   *
+   * @param timeout  The timeout of the command that timed out.
+   * @returns GS_RESPONSE_TIMEOUT
+   */
+  GSResponse responseTimeout(uint32_t timeout);
+
+  /** A command queued by writeCommandAsync() */
+  struct Command {
+    /** Length of the command text in command_text */
+    uint8_t len;
+    uint32_t timeout;
+    line_callback_t line_callback;
+    command_callback_t callback;
+    void *data;
+    cid_t connect_cid;
+  };
 
   /**
    * Internal version of readResponse.
@@ -742,9 +2100,6 @@ protected:
    */
   static const uint8_t MAX_ASYNC_RESPONSE_SIZE = 27;
 
-  // TODO: How big should this buffer be?
-  static const uint16_t RX_DATA_BUF_SIZE = 512;
-
   /** The serial port to use, in serial mode */
   Stream *serial = NULL;
   /** The slave select pin to use, in SPI mode */
@@ -757,22 +2112,209 @@ protected:
   bool spi_xoff;
   /** When true, the previous SPI byte was an escape character */
   bool spi_prev_was_esc;
+  /** When true, keep SS low during a block transfer */
+  bool spi_burst = true;
+
+  /**
+   * Set when the module ignored bytes within a burst, bursts are not
+   * used until SPI_BURST_RETRY_INTERVAL after spi_burst_fallback_start.
+   */
+  bool spi_burst_fallback = false;
+  unsigned long spi_burst_fallback_start;
+
+  /**
+   * The maximum number of data bytes transferred in a single SPI
+   * transaction. Since escaping can double the number of bytes, blocks
+   * can be up to twice this size.
+   */
+  static const uint8_t SPI_BLOCK_SIZE = 16;
+
+  /**
+   * Ringbuffer for (unescaped) bytes received through SPI, that have
+   * not been returned by readRaw() yet. Since bytes are received in
+   * blocks, this buffer holds on to any bytes received after the one
+   * returned by readRaw(). When the rx interrupt is enabled, this
+   * buffer is also filled from the interrupt handler.
+   */
+  uint8_t *spi_rx_buf;
+  /** Size of spi_rx_buf, a power of two and at least 2 * SPI_BLOCK_SIZE */
+  uint8_t spi_rx_buf_size;
+  /** The offset into spi_rx_buf where the next byte should be written to. */
+  volatile uint8_t spi_rx_head;
+  /** The offset into spi_rx_buf where the next byte should be read from. */
+  volatile uint8_t spi_rx_tail;
+
+  /** The instance that has the rx interrupt enabled, if any */
+  static GSCore *rx_interrupt_instance;
+
+  /**
+   * True while running from the rx interrupt. Printing from there can
+   * block forever (e.g. HardwareSerial waiting for its own interrupt),
+   * so logging is suppressed.
+   */
+  bool in_interrupt = false;
+
+  /** Number of errors not logged because of in_interrupt */
+  volatile uint8_t suppressed_errors = 0;
+
+  /**
+   * Ringbuffer for (unescaped) bytes that could not be sent through SPI
+   * yet, because the module sent XOFF.
+   */
+  uint8_t *tx_queue;
+  /** Size of tx_queue, a power of two */
+  uint8_t tx_queue_size;
+  /** The offset into tx_queue where the next byte should be written to. */
+  uint8_t tx_queue_head;
+  /** The offset into tx_queue where the next byte should be read from. */
+  uint8_t tx_queue_tail;
+
+  /** Number of bytes sent, see TxStats */
+  uint32_t tx_sent;
+  /** Number of bytes dropped, see TxStats */
+  uint32_t tx_dropped;
+
+  /** The maximum number of data frames to keep in flight, see setTxPipeline() */
+  uint8_t tx_pipeline = 0;
+
+  enum TxFrameState {
+    GS_TX_FRAME_PENDING,
+    GS_TX_FRAME_OK,
+    GS_TX_FRAME_FAILED,
+  };
+
+  struct TxFrame {
+    cid_t cid;
+    TxFrameState state;
+    /** Sent by writeDataAsync(), reported to its callback */
+    bool async;
+  };
+
+  /**
+   * Data frames sent in pipelined mode. Frames from tx_frames_head up
+   * to tx_frames_acked have been acknowledged, but not reported
+   * through onTxFrame yet. Frames from tx_frames_acked up to
+   * tx_frames_tail are waiting for an acknowledgement. The indices
+   * keep increasing and are masked when used.
+   */
+  TxFrame tx_frames[TX_PIPELINE_SIZE];
+  uint8_t tx_frames_head;
+  uint8_t tx_frames_acked;
+  uint8_t tx_frames_tail;
+
+  /** Number of pipelined frames refused by the module, see TxStats */
+  uint16_t tx_frames_failed;
+
+  /**
+   * Writes queued by writeDataAsync(). Writes from async_head up to
+   * async_send have been sent and are waiting to be reported. The
+   * write at async_send might be partially sent. The indices keep
+   * increasing and are masked when used.
+   */
+  AsyncWrite async_writes[ASYNC_WRITE_QUEUE_SIZE];
+  uint8_t async_head;
+  uint8_t async_send;
+  uint8_t async_tail;
+
+  /** True while sendAsyncWrites() is running */
+  bool async_sending;
+
+  /**
+   * Commands queued by writeCommandAsync(). When command_sent is true,
+   * the command at command_head has been sent and its response is
+   * being read using command_response. The indices keep increasing
+   * and are masked when used.
+   */
+  Command commands[COMMAND_QUEUE_SIZE];
+  uint8_t command_head;
+  uint8_t command_tail;
+  bool command_sent;
+  unsigned long command_start;
+
+  /**
+   * The text of the queued commands that have not been sent yet,
+   * back to back.
+   */
+  uint8_t command_text[COMMAND_TEXT_SIZE];
+  uint8_t command_text_len;
+
+  /** Response parser state and line buffer for the current command */
+  ResponseState command_response;
+  uint8_t command_line[MAX_DATA_LINE_SIZE];
+
+  /**
+   * The response parser that is currently active, if any. Non-escaped
+   * bytes received are passed to it.
+   */
+  ResponseState *rx_response;
+
+  /** Response timeouts, see setTimeout() */
+  uint32_t timeouts[GS_TIMEOUT_COUNT];
+
+  /**
+   * Timeout for the next command, set by setNextTimeout() and
+   * useTimeout() respectively. Both are 0 when unset.
+   */
+  uint32_t next_timeout;
+  uint32_t next_class_timeout;
+
+  /** Timeout for the last command sent through writeCommand() */
+  uint32_t response_timeout;
+
+  /**
+   * Send a marker command after a command timed out and wait for its
+   * response. The module answers commands in order, so the last
+   * response to arrive after sending the marker belongs to the marker,
+   * whether the response to the command that timed out was lost or
+   * not.
+   *
+   * @param block  When true, keep reading until done. When false,
+   *               only check the current state.
+   * @returns true when responses can be matched to commands again.
+   */
+  bool resync(bool block);
+
+  /**
+   * Set when a command timed out. Until resync() finished, no
+   * commands are sent and responses are parsed using late_response
+   * and skipped.
+   */
+  bool resync_needed;
+  /** Set when the marker command was sent */
+  bool resync_sent;
+  /** Set when a response arrived after sending the marker command */
+  bool resync_seen;
+  /** The number of times the marker command went unanswered */
+  uint8_t resync_failures;
+  /** When the marker command was sent, or the last response arrived */
+  unsigned long resync_time;
+  /** How long to wait for the response to the marker command */
+  uint32_t resync_timeout;
+  ResponseState late_response;
+  uint8_t late_line[MAX_RESPONSE_SIZE];
 
   /** True when inside begin() */
   bool initializing = false;
 
   /**
-   * When no data_ready pin is available, this is the (lower 16 bits of)
-   * the microseconds timestamp when the last poll was done.
+   * When no data_ready pin is available, this is the microseconds
+   * timestamp when the last poll was done.
    */
-  uint16_t spi_poll_time;
+  uint32_t spi_poll_time;
 
-  /**
-   * When no data_ready pin is available, we need to poll. Make sure
-   * that when readRaw() will stall for the full 64-byte poll at most
-   * once during this this number of microseconds (and if readRaw() is
-   * called often, it should never stall at all). */
-  static const uint16_t MINIMUM_POLL_INTERVAL = 10000;
+  /** The lower bound for poll_stats.interval, in microseconds */
+  uint32_t spi_poll_min = DEFAULT_MIN_POLL_INTERVAL;
+
+  /** The upper bound for poll_stats.interval, in microseconds */
+  uint32_t spi_poll_max = DEFAULT_MAX_POLL_INTERVAL;
+
+  /** Statistics about polling, interval is the current poll interval */
+  PollStats poll_stats;
+
+  /** See setFastStart() */
+  bool fast_start = false;
+
+  StartupStats startup_stats;
 
   /**
    * Buffer for an (incomplete) asynchronous response, received while no
@@ -789,21 +2331,43 @@ protected:
   uint8_t rx_async_subtype;
 
   /**
-   * Ringbuffer for connection data, received while processing a command
-   * (e.g., when we can't return this connection data to the
-   * application).
+   * Buffer for connection data, received while processing a command or
+   * while reading data for another cid (e.g., when we can't return
+   * this connection data to the application).
+   *
+   * The buffer is divided into blocks of RX_BLOCK_SIZE bytes. Every
+   * cid has its own queue, which is a chain of blocks containing frame
+   * headers and data. Unused blocks are kept in a free list.
    */
-  uint8_t rx_data[RX_DATA_BUF_SIZE];
-  typedef uint16_t rx_data_index_t;
+  uint8_t *rx_data;
+
+  /** For every block, the next block in the same chain */
+  uint8_t *rx_block_next;
+  /** The number of blocks in rx_data */
+  uint8_t rx_block_count;
+  /** The first block in the free list */
+  uint8_t rx_free_block;
+  /** The number of blocks in the free list */
+  uint8_t rx_free_count;
+
+  /** Received data for every cid */
+  RXQueue *rx_queues;
+
+  /** The order in which data for ANY_CID is returned */
+  RXPolicy rx_policy = GS_RX_ROUND_ROBIN;
+
+  /** The cid data for ANY_CID was last returned for */
+  cid_t rx_any_cid;
+
+  /** What to do when a cid is over its budget */
+  RXOverflowPolicy rx_overflow_policy = GS_RX_DROP_OLDEST;
+
+  /** When true, the data for head_frame is dropped */
+  bool rx_discard;
 
   /** Current state for the data stream read from the module */
   RXState rx_state;
 
-  /** The offset into rx_data where the next byte should be written to. */
-  rx_data_index_t rx_data_head;
-  /** The offset into rx_data where the next byte should be read from. */
-  rx_data_index_t rx_data_tail;
-
   /**
    * Data for the next frame to be put into the data buffer.
    * Length indicates the number of data bytes left to read from the
@@ -811,14 +2375,14 @@ protected:
    */
   RXFrame head_frame;
 
+  /** Connection info for every cid */
+  ConnectionInfo *connections;
+
   /**
-   * Data for the frame currently being read from the data buffer.
-   * Length indicates the number of bytes left to read from the data
-   * buffer.
+   * The biggest cid we have room for. Connections and data for cids
+   * above this are ignored.
    */
-  RXFrame tail_frame;
-
-  ConnectionInfo connections[MAX_CID + 1];
+  cid_t max_cid;
 
   /**
    * The cid of the automatic connection created by the network
@@ -864,6 +2428,27 @@ protected:
   Print *debug;
 };
 
+/**
+ * GSCore with buffers of the given sizes.
+ *
+ * @param RxSize       Size of the buffer for received connection data.
+ *                     Should be a power of two.
+ * @param MaxCid       The biggest cid to keep track of. Can be reduced
+ *                     to save memory, when fewer connections are used.
+ * @param SpiRxSize    Size of the buffer for received SPI bytes. Should
+ *                     be a power of two.
+ * @param TxQueueSize  Size of the SPI transmit queue. Should be a power
+ *                     of two.
+ */
+template <uint16_t RxSize = GSCore::RX_DATA_BUF_SIZE,
+          uint8_t MaxCid = GSCore::MAX_CID,
+          uint8_t SpiRxSize = GSCore::SPI_RX_BUF_SIZE,
+          uint8_t TxQueueSize = GSCore::TX_QUEUE_SIZE>
+class GSCoreT : private GSCore::BufferHolder<RxSize, MaxCid, SpiRxSize, TxQueueSize>, public GSCore {
+public:
+  GSCoreT() : GSCore(this->buffers) { }
+};
+
 #endif // GS_CORE_H
 
 // vim: set sw=2 sts=2 expandtab:
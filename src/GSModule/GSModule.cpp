@@ -24,118 +24,213 @@
  * SOFTWARE.
  */
 
+#include <stdarg.h>
 #include "GSModule.h"
 #include "util.h"
 
-GSCore::cid_t GSModule::connectTcp(const IPAddress& ip, uint16_t port)
+GSCore::cid_t GSModuleBase::connectTcp(const IPAddress& ip, uint16_t port)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  char buf[16];
+  formatIpAddress(buf, ip);
+  useTimeout(GS_TIMEOUT_CONNECT);
   writeCommand("AT+NCTCP=%s,%d", buf, port);
   cid_t cid = INVALID_CID;
   if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
+  if (cid > this->max_cid) {
+    // We have no room to keep track of this cid, so close it again
+    disconnect(cid);
+    return INVALID_CID;
+  }
+
   processConnect(cid, ip, port, 0, false);
 
   return cid;
 }
 
-GSCore::cid_t GSModule::connectUdp(const IPAddress& ip, uint16_t port, uint16_t local_port)
+bool GSModuleBase::connectTcpAsync(connect_callback_t callback, void *data, const IPAddress& ip, uint16_t port)
+{
+  if (this->async_connect.busy)
+    return false;
+
+  char buf[16];
+  formatIpAddress(buf, ip);
+  useTimeout(GS_TIMEOUT_CONNECT);
+  if (!writeCommandAsync(NULL, connectTcpDone, this, "AT+NCTCP=%s,%d", buf, port))
+    return false;
+
+  this->async_connect.callback = callback;
+  this->async_connect.data = data;
+  this->async_connect.ip = ip;
+  this->async_connect.port = port;
+  this->async_connect.busy = true;
+  return true;
+}
+
+void GSModuleBase::connectTcpDone(void *data, GSResponse res, cid_t cid)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  GSModuleBase *gs = (GSModuleBase*)data;
+  gs->async_connect.busy = false;
+
+  if (res != GS_SUCCESS || cid > MAX_CID) {
+    cid = INVALID_CID;
+  } else if (cid > gs->max_cid) {
+    // We have no room to keep track of this cid, so close it again
+    gs->useTimeout(GS_TIMEOUT_CONNECT);
+    gs->writeCommandAsync(NULL, NULL, NULL, "AT+NCLOSE=%x", cid);
+    cid = INVALID_CID;
+  } else {
+    gs->processConnect(cid, gs->async_connect.ip, gs->async_connect.port, 0, false);
+  }
+
+  if (gs->async_connect.callback)
+    gs->async_connect.callback(gs->async_connect.data, cid);
+}
+
+GSCore::cid_t GSModuleBase::connectUdp(const IPAddress& ip, uint16_t port, uint16_t local_port)
+{
+  char buf[16];
+  formatIpAddress(buf, ip);
   writeCommand("AT+NCUDP=%s,%d", buf, port);
   cid_t cid = INVALID_CID;
   if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
+  if (cid > this->max_cid) {
+    // We have no room to keep track of this cid, so close it again
+    disconnect(cid);
+    return INVALID_CID;
+  }
+
   processConnect(cid, ip, port, local_port, false);
 
   return cid;
 }
 
-GSCore::cid_t GSModule::listenUdp(uint16_t port)
+GSCore::cid_t GSModuleBase::listenUdp(uint16_t port)
 {
   writeCommand("AT+NSUDP=%u",port);
   cid_t cid = INVALID_CID;
   if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
+  if (cid > this->max_cid) {
+    // We have no room to keep track of this cid, so close it again
+    disconnect(cid);
+    return INVALID_CID;
+  }
+
   processConnect(cid, 0, 0, port, false);
 
   return cid;
 }
 
-bool GSModule::associate(const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
+bool GSModuleBase::associate(const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
 {
-  bool ok = writeCommandCheckOk("AT+WA=\"%s\",%s,%d,%d", ssid, bssid ?: "", channel, best_rssi);
+  useTimeout(GS_TIMEOUT_ASSOCIATE);
+  bool ok = writeCommandCheckOk("AT+WA=\"%q\",%s,%d,%d", ssid, bssid ?: "", channel, best_rssi);
   if (ok)
     processAssociation();
   return ok;
 }
 
-bool GSModule::disassociate()
+bool GSModuleBase::associateAsync(result_callback_t callback, void *data, const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
 {
+  if (this->async_associate.busy)
+    return false;
+
+  useTimeout(GS_TIMEOUT_ASSOCIATE);
+  if (!writeCommandAsync(NULL, associateDone, this, "AT+WA=\"%q\",%s,%d,%d", ssid, bssid ?: "", channel, best_rssi))
+    return false;
+
+  this->async_associate.callback = callback;
+  this->async_associate.data = data;
+  this->async_associate.busy = true;
+  return true;
+}
+
+void GSModuleBase::associateDone(void *data, GSResponse res, cid_t connect_cid)
+{
+  GSModuleBase *gs = (GSModuleBase*)data;
+  gs->async_associate.busy = false;
+
+  bool ok = (res == GS_SUCCESS);
+  if (ok)
+    gs->processAssociation();
+
+  if (gs->async_associate.callback)
+    gs->async_associate.callback(gs->async_associate.data, ok);
+}
+
+bool GSModuleBase::disassociate()
+{
+  useTimeout(GS_TIMEOUT_ASSOCIATE);
   bool ok = writeCommandCheckOk("AT+WD");
   if (ok)
     processDisassociation();
   return ok;
 }
 
-bool GSModule::setDhcp(bool enable, const char *hostname)
+bool GSModuleBase::setDhcp(bool enable, const char *hostname)
 {
+  // When associated, this (re)starts DHCP
+  useTimeout(GS_TIMEOUT_ASSOCIATE);
   if (hostname)
-    return writeCommandCheckOk("AT+NDHCP=%d,\"%s\"", enable, hostname);
+    return writeCommandCheckOk("AT+NDHCP=%d,\"%q\"", enable, hostname);
   else
     return writeCommandCheckOk("AT+NDHCP=%d", enable);
 }
 
-bool GSModule::setStaticIp(const IPAddress& ip, const IPAddress& netmask, const IPAddress& gateway)
+bool GSModuleBase::setStaticIp(const IPAddress& ip, const IPAddress& netmask, const IPAddress& gateway)
 {
-  uint8_t ip_buf[16], nm_buf[16], gw_buf[16];
-  snprintf((char*)ip_buf, sizeof(ip_buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  snprintf((char*)nm_buf, sizeof(nm_buf), "%d.%d.%d.%d", netmask[0], netmask[1], netmask[2], netmask[3]);
-  snprintf((char*)gw_buf, sizeof(gw_buf), "%d.%d.%d.%d", gateway[0], gateway[1], gateway[2], gateway[3]);
+  char ip_buf[16], nm_buf[16], gw_buf[16];
+  formatIpAddress(ip_buf, ip);
+  formatIpAddress(nm_buf, netmask);
+  formatIpAddress(gw_buf, gateway);
   return writeCommandCheckOk("AT+NSET=%s,%s,%s", ip_buf, nm_buf, gw_buf);
 }
 
-bool GSModule::setDns(const IPAddress& dns1, const IPAddress& dns2)
+bool GSModuleBase::setDns(const IPAddress& dns1, const IPAddress& dns2)
 {
-  uint8_t buf1[16], buf2[16];
-  snprintf((char*)buf1, sizeof(buf1), "%d.%d.%d.%d", dns1[0], dns1[1], dns1[2], dns1[3]);
-  snprintf((char*)buf2, sizeof(buf2), "%d.%d.%d.%d", dns2[0], dns2[1], dns2[2], dns2[3]);
+  char buf1[16], buf2[16];
+  formatIpAddress(buf1, dns1);
+  formatIpAddress(buf2, dns2);
 
   return writeCommandCheckOk("AT+DNSSET=%s,%s", buf1, buf2);
 }
 
-bool GSModule::setDns(const IPAddress& dns)
+bool GSModuleBase::setDns(const IPAddress& dns)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", dns[0], dns[1], dns[2], dns[3]);
+  char buf[16];
+  formatIpAddress(buf, dns);
 
   return writeCommandCheckOk("AT+DNSSET=%s", buf);
 }
 
-bool GSModule::disconnect(cid_t cid)
+bool GSModuleBase::disconnect(cid_t cid)
 {
   if (cid > MAX_CID)
     return false;
+  // Closing a TCP connection waits for the other side
+  useTimeout(GS_TIMEOUT_CONNECT);
   return writeCommandCheckOk("AT+NCLOSE=%x", cid);
 }
 
-bool GSModule::timeSync(const IPAddress& server, uint32_t interval, uint8_t timeout)
+bool GSModuleBase::timeSync(const IPAddress& server, uint32_t interval, uint8_t timeout)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", server[0], server[1], server[2], server[3]);
+  char buf[16];
+  formatIpAddress(buf, server);
 
-  // First, send the command without an interval, to force a sync now
+  // First, send the command without an interval, to force a sync now.
+  // This waits for the server, for up to timeout seconds.
+  useTimeout(GS_TIMEOUT_CONNECT, timeout * 1000UL);
   if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,0", buf, timeout))
     return false;
 
   if (interval) {
     // Then, schedule periodic syncs if requested
-    if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,1,%d", buf, timeout, interval))
+    if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,1,%lu", buf, timeout, (unsigned long)interval))
       return false;
   }
   return true;
@@ -150,20 +245,54 @@ static void parse_ip_response(const uint8_t *buf, uint16_t len, void *data)
     *ip = INADDR_NONE;
 }
 
-IPAddress GSModule::dnsLookup(const char *name)
+IPAddress GSModuleBase::dnsLookup(const char *name)
 {
   IPAddress result = INADDR_NONE;
+  useTimeout(GS_TIMEOUT_DNS);
   writeCommand("AT+DNSLOOKUP=%s", name);
   if (readResponse(parse_ip_response, &result) != GS_SUCCESS)
     result = INADDR_NONE;
   return result;
 }
 
-bool GSModule::enableTls(cid_t cid, const char *certname)
+bool GSModuleBase::dnsLookupAsync(dns_callback_t callback, void *data, const char *name)
 {
-  if (cid > MAX_CID)
+  if (this->async_dns.busy)
+    return false;
+
+  useTimeout(GS_TIMEOUT_DNS);
+  if (!writeCommandAsync(dnsLookupLine, dnsLookupDone, this, "AT+DNSLOOKUP=%s", name))
     return false;
 
+  this->async_dns.callback = callback;
+  this->async_dns.data = data;
+  this->async_dns.ip = INADDR_NONE;
+  this->async_dns.busy = true;
+  return true;
+}
+
+void GSModuleBase::dnsLookupLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  GSModuleBase *gs = (GSModuleBase*)data;
+  parse_ip_response(buf, len, &gs->async_dns.ip);
+}
+
+void GSModuleBase::dnsLookupDone(void *data, GSResponse res, cid_t connect_cid)
+{
+  GSModuleBase *gs = (GSModuleBase*)data;
+  gs->async_dns.busy = false;
+
+  IPAddress ip = (res == GS_SUCCESS ? gs->async_dns.ip : INADDR_NONE);
+  if (gs->async_dns.callback)
+    gs->async_dns.callback(gs->async_dns.data, ip);
+}
+
+bool GSModuleBase::enableTls(cid_t cid, const char *certname)
+{
+  if (cid > this->max_cid)
+    return false;
+
+  useTimeout(GS_TIMEOUT_TLS);
   if (writeCommandCheckOk("AT+SSLOPEN=%x,%s", cid, certname)) {
     this->connections[cid].ssl = true;
     return true;
@@ -174,7 +303,44 @@ bool GSModule::enableTls(cid_t cid, const char *certname)
   }
 }
 
-bool GSModule::addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+bool GSModuleBase::enableTlsAsync(result_callback_t callback, void *data, cid_t cid, const char *certname)
+{
+  if (cid > this->max_cid || this->async_tls.busy)
+    return false;
+
+  useTimeout(GS_TIMEOUT_TLS);
+  if (!writeCommandAsync(NULL, enableTlsDone, this, "AT+SSLOPEN=%x,%s", cid, certname))
+    return false;
+
+  this->async_tls.callback = callback;
+  this->async_tls.data = data;
+  this->async_tls.cid = cid;
+  this->async_tls.busy = true;
+  return true;
+}
+
+void GSModuleBase::enableTlsDone(void *data, GSResponse res, cid_t connect_cid)
+{
+  GSModuleBase *gs = (GSModuleBase*)data;
+  gs->async_tls.busy = false;
+
+  cid_t cid = gs->async_tls.cid;
+  bool ok = (res == GS_SUCCESS);
+  if (ok) {
+    gs->connections[cid].ssl = true;
+  } else {
+    gs->connections[cid].error = true;
+    gs->processDisconnect(cid);
+  }
+
+  if (gs->async_tls.callback)
+    gs->async_tls.callback(gs->async_tls.data, ok);
+}
+
+bool GSModuleBase::addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+  // The timeout is also used for the response after the certificate
+  if (to_flash)
+    useTimeout(GS_TIMEOUT_FLASH);
   if (!writeCommandCheckOk("AT+TCERTADD=%s,0,%d,%d", certname, len, !to_flash))
     return false;
 
@@ -184,25 +350,25 @@ bool GSModule::addCert(const char *certname, bool to_flash, const uint8_t *buf,
   return readResponse() == GS_SUCCESS;
 }
 
-bool GSModule::setAutoConnectClient(const IPAddress &ip, uint16_t port, Protocol protocol)
+bool GSModuleBase::setAutoConnectClient(const IPAddress &ip, uint16_t port, Protocol protocol)
 {
   char buf[16];
-  snprintf(buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  formatIpAddress(buf, ip);
 
   return setAutoConnectClient(buf, port, protocol);
 }
 
-bool GSModule::setAutoConnectClient(const char *host, uint16_t port, Protocol protocol)
+bool GSModuleBase::setAutoConnectClient(const char *host, uint16_t port, Protocol protocol)
 {
   return writeCommandCheckOk("AT+NAUTO=0,%d,%s,%d", protocol, host, port);
 }
 
-bool GSModule::setAutoConnectServer(uint16_t port, Protocol protocol)
+bool GSModuleBase::setAutoConnectServer(uint16_t port, Protocol protocol)
 {
   return writeCommandCheckOk("AT+NAUTO=1,%d,,%d", protocol, port);
 }
 
-bool GSModule::setNcm(bool enabled, bool associate_only, bool remember, NCMMode mode)
+bool GSModuleBase::setNcm(bool enabled, bool associate_only, bool remember, NCMMode mode)
 {
   bool res = writeCommandCheckOk("AT+NCMAUTO=%d,%d,%d,%d", mode, enabled, !associate_only, !remember);
   if (!enabled && res)
@@ -210,4 +376,145 @@ bool GSModule::setNcm(bool enabled, bool associate_only, bool remember, NCMMode
   return res;
 }
 
+// Print that compares everything written to it with an expected value,
+// without buffering it
+class ComparePrint : public Print {
+public:
+  ComparePrint(const uint8_t *value, uint16_t len) : value(value), len(len), pos(0), same(true) { }
+  size_t write(uint8_t c)
+  {
+    if (this->pos >= this->len || this->value[this->pos] != c)
+      this->same = false;
+    this->pos++;
+    return 1;
+  }
+  bool matches() { return this->same && this->pos == this->len; }
+
+private:
+  const uint8_t *value;
+  uint16_t len;
+  uint16_t pos;
+  bool same;
+};
+
+// Returns true when value equals the formatted string
+static bool value_matches(const uint8_t *value, uint16_t len, const char *fmt, ...)
+{
+  ComparePrint cmp(value, len);
+  va_list args;
+  va_start(args, fmt);
+  GSCore::formatCommand(cmp, fmt, args);
+  va_end(args);
+  return cmp.matches();
+}
+
+static bool starts_with(const uint8_t *buf, uint16_t len, const char *prefix)
+{
+  uint16_t prefix_len = strlen(prefix);
+  return len >= prefix_len && memcmp(buf, prefix, prefix_len) == 0;
+}
+
+struct ConfigParseState {
+  const GSModuleBase::GSConfig *config;
+  // Number of profile headers seen
+  uint8_t profiles;
+  // Settings that already have the configured value (GSConfigItem bits)
+  uint8_t same;
+};
+
+// Compare a single "+KEY=VALUE" setting from AT&V with the config
+static void parse_config_setting(const uint8_t *buf, uint16_t len, void *data)
+{
+  ConfigParseState *state = (ConfigParseState*)data;
+  const uint8_t *eq = (const uint8_t*)memchr(buf, '=', len);
+  if (len < 2 || buf[0] != '+' || !eq)
+    return;
+
+  const GSModuleBase::GSConfig &c = *state->config;
+  const uint8_t *key = buf + 1;
+  uint16_t key_len = eq - key;
+  const uint8_t *value = eq + 1;
+  uint16_t value_len = buf + len - value;
+
+  if (key_len == 5 && starts_with(key, key_len, "NDHCP")) {
+    // The hostname is not shown, so it cannot be compared
+    if (!c.dhcp_hostname && value_matches(value, value_len, "%d", c.dhcp))
+      state->same |= GSModuleBase::GS_CONFIG_DHCP;
+  } else if (key_len == 5 && starts_with(key, key_len, "WAUTH")) {
+    if (value_matches(value, value_len, "%d", c.auth))
+      state->same |= GSModuleBase::GS_CONFIG_AUTH;
+  } else if (key_len == 4 && starts_with(key, key_len, "WSEC")) {
+    if (value_matches(value, value_len, "%d", c.security))
+      state->same |= GSModuleBase::GS_CONFIG_SECURITY;
+  } else if (key_len == 5 && starts_with(key, key_len, "WAUTO")) {
+    if (c.auto_ssid && value_matches(value, value_len, "%d,\"%s\",%s,%d", c.auto_mode, c.auto_ssid, c.auto_bssid ?: "", c.auto_channel))
+      state->same |= GSModuleBase::GS_CONFIG_AUTO_ASSOCIATE;
+  } else if (key_len == 5 && starts_with(key, key_len, "NAUTO")) {
+    // Client mode is 0
+    if (c.auto_host && value_matches(value, value_len, "0,%d,%s,%u", c.auto_protocol, c.auto_host, c.auto_port))
+      state->same |= GSModuleBase::GS_CONFIG_AUTO_CONNECT;
+  }
+}
+
+static void parse_config_line(const uint8_t *buf, uint16_t len, void *data)
+{
+  ConfigParseState *state = (ConfigParseState*)data;
+  GSCore::parseSettingsLine(buf, len, &state->profiles, parse_config_setting, state);
+}
+
+static void config_applied(GSModuleBase::GSConfigResult *res, uint8_t item, bool ok)
+{
+  res->changed |= item;
+  if (!ok)
+    res->failed |= item;
+}
+
+bool GSModuleBase::applyConfig(const GSConfig &config, GSConfigResult *result)
+{
+  ConfigParseState state = {&config, 0, 0};
+  useTimeout(GS_TIMEOUT_FLASH);
+  writeCommand("AT&V");
+  if (readResponse(parse_config_line, &state) != GS_SUCCESS)
+    state.same = 0;
+
+  GSConfigResult res = {0, 0};
+  if (config.dhcp >= 0 && !(state.same & GS_CONFIG_DHCP))
+    config_applied(&res, GS_CONFIG_DHCP, setDhcp(config.dhcp, config.dhcp_hostname));
+
+  if (config.auth >= 0 && !(state.same & GS_CONFIG_AUTH))
+    config_applied(&res, GS_CONFIG_AUTH, setAuth((GSAuth)config.auth));
+
+  if (config.security >= 0 && !(state.same & GS_CONFIG_SECURITY))
+    config_applied(&res, GS_CONFIG_SECURITY, setSecurity((GSSecurity)config.security));
+
+  if (config.wpa_passphrase)
+    config_applied(&res, GS_CONFIG_WPA_PASSPHRASE, setWpaPassphrase(config.wpa_passphrase));
+
+  if (config.auto_ssid && !(state.same & GS_CONFIG_AUTO_ASSOCIATE))
+    config_applied(&res, GS_CONFIG_AUTO_ASSOCIATE, setAutoAssociate(config.auto_ssid, config.auto_bssid, config.auto_channel, config.auto_mode));
+
+  if (config.auto_host && !(state.same & GS_CONFIG_AUTO_CONNECT))
+    config_applied(&res, GS_CONFIG_AUTO_CONNECT, setAutoConnectClient(config.auto_host, config.auto_port, config.auto_protocol));
+
+  if (config.ncm >= 0)
+    config_applied(&res, GS_CONFIG_NCM, setNcm(config.ncm, config.ncm_associate_only, config.ncm_remember, config.ncm_mode));
+
+  // The NCM settings are only part of the profile when remembered
+  uint8_t saved = res.changed;
+  if (!config.ncm_remember)
+    saved &= ~GS_CONFIG_NCM;
+  if (!config.save_unverified) {
+    saved &= ~(GS_CONFIG_WPA_PASSPHRASE | GS_CONFIG_NCM);
+    if (config.dhcp_hostname)
+      saved &= ~GS_CONFIG_DHCP;
+  }
+
+  if (config.save_profile >= 0 && saved)
+    config_applied(&res, GS_CONFIG_PROFILE, saveProfile(config.save_profile));
+
+  if (result)
+    *result = res;
+  return res.failed == 0;
+}
+
 // vim: set sw=2 sts=2 expandtab:
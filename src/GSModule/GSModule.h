@@ -37,8 +37,11 @@
  *
  * This class defines some higher level methods for sending commands,
  * @see GSCore for the begin/end and lower level methods.
+ *
+ * This class does not contain any buffers itself, use GSModule (or
+ * GSModuleT to specify buffer sizes) to get an instance.
  */
-class GSModule : public GSCore {
+class GSModuleBase : public GSCore {
 public:
   enum GSAuth {
     GS_AUTH_NONE = 0,
@@ -73,9 +76,6 @@ public:
    * Either pass GS_SECURITY_AUTO to let the hardware autodetect, or
    * pass a bitwise or of one or more of the other values to restrict to
    * those options.
-   *
-   * TODO: Double quotes and backslashes in the passphrase should be
-   * backslash-escaped
    */
   bool setSecurity(GSSecurity sec)
   {
@@ -87,7 +87,7 @@ public:
    */
   bool setWpaPassphrase(const char *passphrase)
   {
-    return writeCommandCheckOk("AT+WWPA=\"%s\"", passphrase);
+    return writeCommandCheckOk("AT+WWPA=\"%q\"", passphrase);
   }
 
   /**
@@ -105,13 +105,11 @@ public:
    * another SSID, a new PSK will be calculated also using this
    * passphrase but the new SSID. That new PSK will replace the
    * precalculated PSK as well.
-   *
-   * TODO: Double quotes and backslashes in the SSID and passphrase
-   * should be backslash-escaped
    */
   bool setPskPassphrase(const char *passphrase, const char *ssid)
   {
-    return writeCommandCheckOk("AT+WPAPSK=\"%s\",\"%s\"", ssid, passphrase);
+    useTimeout(GS_TIMEOUT_ASSOCIATE);
+    return writeCommandCheckOk("AT+WPAPSK=\"%q\",\"%q\"", ssid, passphrase);
   }
 
   /**
@@ -125,12 +123,31 @@ public:
    * @param best_rssi When multiple possible access points are available,
    *                  use the one with the best rssi, or just use an
    *                  arbitrary one.
-   *
-   * TODO: Double quotes and backslashes in the passphrase should be
-   * backslash-escaped
    */
   bool associate(const char *ssid, const char *bssid = NULL, uint8_t channel = 0, bool best_rssi = true);
 
+  /**
+   * Callback for associateAsync() and enableTlsAsync().
+   *
+   * @param data  The data passed to the *Async() method.
+   * @param ok    Whether the command was successful.
+   */
+  typedef void (*result_callback_t)(void *data, bool ok);
+
+  /**
+   * Like associate(), but without waiting for the module. The command
+   * is queued using writeCommandAsync() and the callback is called
+   * from loop() when it completes. Only one associateAsync() can be in
+   * progress at a time.
+   *
+   * @param callback  Called when done, can be NULL.
+   * @param data      Passed to the callback.
+   *
+   * @returns false when the command could not be queued. The callback
+   * is not called then.
+   */
+  bool associateAsync(result_callback_t callback, void *data, const char *ssid, const char *bssid = NULL, uint8_t channel = 0, bool best_rssi = true);
+
   /**
    * Disassociate from the current network.
    */
@@ -176,6 +193,7 @@ public:
    */
   bool saveProfile(uint8_t profile)
   {
+    useTimeout(GS_TIMEOUT_FLASH);
     return writeCommandCheckOk("AT&W%d", profile);
   }
 
@@ -187,6 +205,7 @@ public:
    */
   bool loadProfile(uint8_t profile)
   {
+    useTimeout(GS_TIMEOUT_FLASH);
     return writeCommandCheckOk("ATZ%d", profile);
   }
 
@@ -199,6 +218,7 @@ public:
    */
   bool setDefaultProfile(uint8_t profile)
   {
+    useTimeout(GS_TIMEOUT_FLASH);
     return writeCommandCheckOk("AT&Y%d", profile);
   }
 
@@ -362,6 +382,13 @@ public:
    */
   bool enableTls(cid_t cid, const char *certname);
 
+  /**
+   * Like enableTls(), but without waiting for the handshake. See
+   * associateAsync(). Only one enableTlsAsync() can be in progress at
+   * a time.
+   */
+  bool enableTlsAsync(result_callback_t callback, void *data, cid_t cid, const char *certname);
+
   /**
    * Save the given certificate to the module's flash or RAM
    * (depending on to_flash). The name can be any string and should be
@@ -375,6 +402,7 @@ public:
    */
   bool delCert(const char *certname)
   {
+    useTimeout(GS_TIMEOUT_FLASH);
     return writeCommandCheckOk("AT+TCERTDEL=%s", certname);
   }
 
@@ -401,6 +429,22 @@ public:
    */
   IPAddress dnsLookup(const char *name);
 
+  /**
+   * Callback for dnsLookupAsync().
+   *
+   * @param data  The data passed to dnsLookupAsync().
+   * @param ip    The IP address found, or 0.0.0.0 when the lookup
+   *              failed.
+   */
+  typedef void (*dns_callback_t)(void *data, IPAddress ip);
+
+  /**
+   * Like dnsLookup(), but without waiting for the result. See
+   * associateAsync(). Only one dnsLookupAsync() can be in progress at
+   * a time.
+   */
+  bool dnsLookupAsync(dns_callback_t callback, void *data, const char *name);
+
   /**
    * Setup a new TCP connection to the given ip and port.
    *
@@ -409,6 +453,22 @@ public:
    */
   cid_t connectTcp(const IPAddress& ip, uint16_t port);
 
+  /**
+   * Callback for connectTcpAsync().
+   *
+   * @param data  The data passed to connectTcpAsync().
+   * @param cid   The cid of the new connection, or INVALID_CID when
+   *              connecting failed.
+   */
+  typedef void (*connect_callback_t)(void *data, cid_t cid);
+
+  /**
+   * Like connectTcp(), but without waiting for the connection to be
+   * set up. See associateAsync(). Only one connectTcpAsync() can be in
+   * progress at a time.
+   */
+  bool connectTcpAsync(connect_callback_t callback, void *data, const IPAddress& ip, uint16_t port);
+
  /**
   * Setup a listening UDP server on the given port.
   *
@@ -466,7 +526,7 @@ public:
    */
   bool setAutoAssociate(const char *ssid, const char *bssid = NULL, int channel = 0, WMode mode = GS_INFRASTRUCTURE)
   {
-    return writeCommandCheckOk("AT+WAUTO=%d,\"%s\",%s,%d", mode, ssid, bssid ?: "", channel);
+    return writeCommandCheckOk("AT+WAUTO=%d,\"%q\",%s,%d", mode, ssid, bssid ?: "", channel);
   }
 
   enum Protocol {
@@ -549,8 +609,169 @@ public:
    *                        through setAutoAssociate.
    */
   bool setNcm(bool enabled, bool associate_only = true, bool remember = false, NCMMode mode = GS_NCM_STATION);
+
+/*******************************************************
+ * Declarative configuration
+ *******************************************************/
+
+  /** Settings in GSConfig, used as bits in GSConfigResult */
+  enum GSConfigItem {
+    GS_CONFIG_DHCP = 1,
+    GS_CONFIG_AUTH = 2,
+    GS_CONFIG_SECURITY = 4,
+    GS_CONFIG_WPA_PASSPHRASE = 8,
+    GS_CONFIG_AUTO_ASSOCIATE = 16,
+    GS_CONFIG_AUTO_CONNECT = 32,
+    GS_CONFIG_NCM = 64,
+    GS_CONFIG_PROFILE = 128,
+  };
+
+  /**
+   * A set of settings to apply with applyConfig(). Every setting
+   * corresponds to one of the setter methods above. Settings left at
+   * their initial value are not touched.
+   */
+  struct GSConfig {
+    /** Passed to setDhcp(), -1 to leave unchanged */
+    int8_t dhcp = -1;
+    const char *dhcp_hostname = NULL;
+
+    /** Passed to setAuth(), -1 to leave unchanged */
+    int8_t auth = -1;
+
+    /** Passed to setSecurity(), -1 to leave unchanged */
+    int16_t security = -1;
+
+    /** Passed to setWpaPassphrase(), NULL to leave unchanged */
+    const char *wpa_passphrase = NULL;
+
+    /** Passed to setAutoAssociate(), NULL to leave unchanged */
+    const char *auto_ssid = NULL;
+    const char *auto_bssid = NULL;
+    uint8_t auto_channel = 0;
+    WMode auto_mode = GS_INFRASTRUCTURE;
+
+    /** Passed to setAutoConnectClient(), NULL to leave unchanged */
+    const char *auto_host = NULL;
+    uint16_t auto_port = 0;
+    Protocol auto_protocol = GS_TCP;
+
+    /** Passed to setNcm(), -1 to leave unchanged */
+    int8_t ncm = -1;
+    bool ncm_associate_only = true;
+    bool ncm_remember = false;
+    NCMMode ncm_mode = GS_NCM_STATION;
+
+    /**
+     * When 0 or 1 and any of the settings stored in the profile was
+     * changed, save the current profile to this stored profile
+     * afterwards (see saveProfile()).
+     */
+    int8_t save_profile = -1;
+
+    /**
+     * Settings that cannot be read back (see applyConfig()) are always
+     * sent, so they cause a save on every call. Set this to false to
+     * only save when a setting was verified to be different, at the
+     * risk of not saving a changed passphrase, NCM setting or DHCP
+     * hostname.
+     */
+    bool save_unverified = true;
+  };
+
+  /** The outcome of applyConfig(), using GSConfigItem bits */
+  struct GSConfigResult {
+    /** Settings for which a command was sent */
+    uint8_t changed;
+    /** Settings for which the command failed */
+    uint8_t failed;
+  };
+
+  /**
+   * Apply the given configuration. This reads the current settings
+   * once (using AT&V) and only sends the commands for settings that
+   * differ from the configuration, so reapplying the same
+   * configuration on every boot costs a single round trip.
+   *
+   * Some settings cannot be read back, so they are always sent when
+   * given: the WPA passphrase (AT&V masks it), the NCM settings (not
+   * shown by AT&V) and DHCP when a hostname is given. These also cause
+   * the profile to be saved, unless save_unverified is false. When
+   * reading the current settings fails, all given settings are sent.
+   *
+   * @param config  The settings to apply.
+   * @param result  When not NULL, filled with the settings that were
+   *                changed and that failed.
+   * @returns true when all commands sent were successful.
+   */
+  bool applyConfig(const GSConfig &config, GSConfigResult *result = NULL);
+
+protected:
+  template <class B>
+  GSModuleBase(B &buffers) : GSCore(buffers) { }
+
+  /**
+   * State of the *Async() methods, which is needed to update our
+   * own state once the command completes.
+   */
+  struct {
+    result_callback_t callback;
+    void *data;
+    bool busy = false;
+  } async_associate;
+
+  struct {
+    connect_callback_t callback;
+    void *data;
+    uint32_t ip;
+    uint16_t port;
+    bool busy = false;
+  } async_connect;
+
+  struct {
+    dns_callback_t callback;
+    void *data;
+    IPAddress ip;
+    bool busy = false;
+  } async_dns;
+
+  struct {
+    result_callback_t callback;
+    void *data;
+    cid_t cid;
+    bool busy = false;
+  } async_tls;
+
+  /** Command callbacks for the *Async() methods, data is this */
+  static void associateDone(void *data, GSResponse res, cid_t connect_cid);
+  static void connectTcpDone(void *data, GSResponse res, cid_t connect_cid);
+  static void dnsLookupLine(const uint8_t *buf, uint16_t len, void *data);
+  static void dnsLookupDone(void *data, GSResponse res, cid_t connect_cid);
+  static void enableTlsDone(void *data, GSResponse res, cid_t connect_cid);
 };
 
+/**
+ * GSModuleBase with buffers of the given sizes.
+ *
+ * For example, to buffer two complete bulk frames (up to 1400 bytes
+ * each) for at most four connections (cids 0 up to 3), use:
+ *
+ *    GSModuleT<4096, 3> gs;
+ *
+ * @see GSCoreT for the meaning of the template parameters.
+ */
+template <uint16_t RxSize = GSCore::RX_DATA_BUF_SIZE,
+          uint8_t MaxCid = GSCore::MAX_CID,
+          uint8_t SpiRxSize = GSCore::SPI_RX_BUF_SIZE,
+          uint8_t TxQueueSize = GSCore::TX_QUEUE_SIZE>
+class GSModuleT : private GSCore::BufferHolder<RxSize, MaxCid, SpiRxSize, TxQueueSize>, public GSModuleBase {
+public:
+  GSModuleT() : GSModuleBase(this->buffers) { }
+};
+
+/** GSModuleBase with the default buffer sizes */
+typedef GSModuleT<> GSModule;
+
 #endif // GS_MODULE_H
 
 // vim: set sw=2 sts=2 expandtab:
@@ -31,7 +31,7 @@
 
 class GSTcpClient : public  GSClient {
   public:
-    GSTcpClient(GSModule &gs) : GSClient(gs) { } ;
+    GSTcpClient(GSModuleBase &gs) : GSClient(gs) { } ;
 
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
@@ -31,7 +31,7 @@
 
 class GSUdpClient : public  GSClient {
   public:
-    GSUdpClient(GSModule &gs) : GSClient(gs) { } ;
+    GSUdpClient(GSModuleBase &gs) : GSClient(gs) { } ;
 
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
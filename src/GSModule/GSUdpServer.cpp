@@ -27,7 +27,7 @@
 #include "GSUdpServer.h"
 #include "util.h"
 
-uint8_t GSUdpServer::begin(uint16_t port)
+uint8_t GSUdpServerBase::begin(uint16_t port)
 {
   GSModule::cid_t cid = this->gs.listenUdp(port);
   if (cid == GSModule::INVALID_CID)
@@ -37,7 +37,7 @@ uint8_t GSUdpServer::begin(uint16_t port)
   return true;
 }
 
-int GSUdpServer::parsePacket()
+int GSUdpServerBase::parsePacket()
 {
   // If there are still bytes pending from the previous packet, drop
   // them. If not all of them are directly available, don't block but
@@ -54,70 +54,69 @@ int GSUdpServer::parsePacket()
   return this->rx_frame.length;
 }
 
-IPAddress GSUdpServer::remoteIP()
+IPAddress GSUdpServerBase::remoteIP()
 {
   return this->rx_frame.ip;
 }
 
-uint16_t GSUdpServer::remotePort()
+uint16_t GSUdpServerBase::remotePort()
 {
   return this->rx_frame.port;
 }
 
-int GSUdpServer::beginPacket(IPAddress ip, uint16_t port)
+int GSUdpServerBase::beginPacket(IPAddress ip, uint16_t port)
 {
   this->tx_ip = ip;
   this->tx_port = port;
+  this->tx_len = 0;
+  this->tx_overflow = false;
+  clearWriteError();
 
   return true;
 }
 
-int GSUdpServer::beginPacket(const char *host, uint16_t port)
+int GSUdpServerBase::beginPacket(const char *host, uint16_t port)
 {
-  if (!GSCore::parseIpAddress(&(this->tx_ip), host, strlen(host))) return false;
-  this->tx_port = port;
-  return true;
+  IPAddress ip;
+  if (!GSCore::parseIpAddress(&ip, host, strlen(host))) return false;
+  return beginPacket(ip, port);
 }
 
-int GSUdpServer::endPacket()
+int GSUdpServerBase::endPacket()
 {
-  int res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
-  free(this->tx_buf);
-  this->tx_buf = NULL;
+  int res = false;
+  if (!this->tx_overflow)
+    res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
   this->tx_len = 0;
+  this->tx_overflow = false;
   return res;
 }
 
-size_t GSUdpServer::write(uint8_t c)
+size_t GSUdpServerBase::write(uint8_t c)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + 1);
-  if (!newbuf)
-    return 0;
-
-  this->tx_buf = newbuf;
-  this->tx_buf[this->tx_len++] = c;
-  return 1;
+  return write(&c, 1);
 }
 
-size_t GSUdpServer::write(const uint8_t *buf, size_t size)
+size_t GSUdpServerBase::write(const uint8_t *buf, size_t size)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + size);
-  if (!newbuf)
-    return 0;
+  if (size > (size_t)(this->tx_size - this->tx_len)) {
+    size = this->tx_size - this->tx_len;
+    this->tx_overflow = true;
+    setWriteError();
+  }
 
-  this->tx_buf = newbuf;
   memcpy(this->tx_buf + this->tx_len, buf, size);
   this->tx_len += size;
 
   return size;
 }
 
-int GSUdpServer::available()
+int GSUdpServerBase::available()
 {
   return this->rx_frame.length;
 }
 
-int GSUdpServer::read()
+int GSUdpServerBase::read()
 {
   if (!this->rx_frame.length)
     return 0;
@@ -128,7 +127,7 @@ int GSUdpServer::read()
   return c;
 }
 
-int GSUdpServer::read(uint8_t *buf, size_t size)
+int GSUdpServerBase::read(uint8_t *buf, size_t size)
 {
   if (!this->rx_frame.length)
     return 0;
@@ -138,7 +137,7 @@ int GSUdpServer::read(uint8_t *buf, size_t size)
   return read;
 }
 
-int GSUdpServer::peek()
+int GSUdpServerBase::peek()
 {
   if (!this->rx_frame.length)
     return 0;
@@ -146,18 +145,18 @@ int GSUdpServer::peek()
   return gs.peekData(this->cid);
 }
 
-void GSUdpServer::flush()
+void GSUdpServerBase::flush()
 {
   // Nothing todo, we can't write anything to the gainspan module
   // without also ending the packet
 }
 
-void GSUdpServer::stop()
+void GSUdpServerBase::stop()
 {
   gs.disconnect(this->cid);
 }
 
-GSUdpServer& GSUdpServer::operator =(GSCore::cid_t cid)
+GSUdpServerBase& GSUdpServerBase::operator =(GSCore::cid_t cid)
 {
   this->cid = cid;
   return *this;
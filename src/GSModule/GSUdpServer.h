@@ -32,9 +32,23 @@
 
 #include "GSModule.h"
 
-class GSUdpServer : public UDP {
+/**
+ * UDP server on a Gainspan module.
+ *
+ * Outgoing packets are collected in a fixed-size buffer, so this class
+ * does not contain the buffer itself. Use GSUdpServer (or GSUdpServerT
+ * to specify the buffer size) to get an instance.
+ */
+class GSUdpServerBase : public UDP {
   public:
-    GSUdpServer(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
+    /** Biggest packet that can be sent, limited by the module */
+    static const uint16_t MAX_PACKET_SIZE = GSCore::MAX_FRAME_SIZE;
+
+    /**
+     * Default size of the buffer for outgoing packets, big enough for
+     * any packet the module can send.
+     */
+    static const uint16_t TX_BUF_SIZE = MAX_PACKET_SIZE;
 
     /****************************************************************
      * Stuff from Udp / Stream / Print
@@ -47,9 +61,20 @@ class GSUdpServer : public UDP {
     virtual uint16_t remotePort();
     virtual int beginPacket(IPAddress ip, uint16_t port);
     virtual int beginPacket(const char *host, uint16_t port);
+    /**
+     * Send the packet. Returns false when sending failed, or when more
+     * data was written than fits in the packet buffer (in which case
+     * nothing is sent, since the packet would be truncated).
+     */
     virtual int endPacket();
     virtual void stop();
 
+    /**
+     * Add data to the packet being prepared. When the data does not
+     * fit in the packet buffer, only the part that fits is added and
+     * the write error is set (see Print::getWriteError()). The write
+     * error is cleared by beginPacket().
+     */
     virtual size_t write(uint8_t);
     virtual size_t write(const uint8_t *buf, size_t size);
     virtual int available();
@@ -58,13 +83,16 @@ class GSUdpServer : public UDP {
     virtual int read(unsigned char *buf, size_t size);
     virtual int peek();
     virtual void flush();
-    GSUdpServer& operator =(GSCore::cid_t cid);
+    GSUdpServerBase& operator =(GSCore::cid_t cid);
 
     // Include other overloads of write
     using Print::write;
 
   protected:
-    GSModule &gs;
+    GSUdpServerBase(GSModuleBase &gs, uint8_t *tx_buf, uint16_t tx_size)
+      : gs(gs), tx_buf(tx_buf), tx_size(tx_size) { }
+
+    GSModuleBase &gs;
     GSModule::cid_t cid = GSModule::INVALID_CID;
     // Packet currently being received. When length is 0, the other
     // fields might be invalid.
@@ -74,12 +102,43 @@ class GSUdpServer : public UDP {
     IPAddress tx_ip = INADDR_NONE;
     uint16_t tx_port = 0;
     // Buffer into which we're accumulating the next packet.
-    uint8_t *tx_buf = NULL;
-    // Length of data in sendBuf
-    size_t tx_len = 0;
+    uint8_t *tx_buf;
+    // Size of tx_buf
+    uint16_t tx_size;
+    // Length of data in tx_buf
+    uint16_t tx_len = 0;
+    // Was data written that did not fit in tx_buf?
+    bool tx_overflow = false;
+};
 
+/**
+ * GSUdpServerBase with a buffer for outgoing packets of the given
+ * size. For example, to save memory when only small packets are sent:
+ *
+ *    GSUdpServerT<128> server(gs);
+ *
+ * @param TxSize   The biggest packet that can be sent, at most
+ *                 MAX_PACKET_SIZE.
+ */
+template <uint16_t TxSize = GSUdpServerBase::TX_BUF_SIZE>
+class GSUdpServerT : public GSUdpServerBase {
+  public:
+    GSUdpServerT(GSModuleBase &gs) : GSUdpServerBase(gs, tx_data, TxSize)
+    {
+      static_assert(TxSize > 0 && TxSize <= MAX_PACKET_SIZE, "TxSize must be between 1 and MAX_PACKET_SIZE");
+    }
+
+    // Explicitely inherit operator=, since the default assignment
+    // operator shows it.
+    using GSUdpServerBase::operator=;
+
+  protected:
+    uint8_t tx_data[TxSize];
 };
 
+/** GSUdpServerBase with the default buffer size */
+typedef GSUdpServerT<> GSUdpServer;
+
 #endif // _GS_UDP_SERVER_H
 
 // vim: set sw=2 sts=2 expandtab: